@@ -1,12 +1,25 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define MAX_REG_LEN 1000
-#define MAX_TOKEN_LEN 100
 
 #define OP_EPS  1
 #define OP_STAR 2
@@ -14,15 +27,122 @@
 #define OP_QUES 4
 #define OP_CON  5
 #define OP_UNI  6
-#define OP_DIG  7
-#define OP_AZ   8
-#define OP_az   9
-#define OP_Az   10
-#define OP_W    11
+#define OP_SET  7
 
-#define TRANS_ENTRY_PER_RECORD 4
-#define NUM_SYMBOLS 128
-#define EPS 0
+#define MAX_REPEAT 255
+
+#define NUM_SYMBOLS 256
+#define SET_WORDS   (NUM_SYMBOLS / 64)
+#define MAX_CLASS   64
+
+// =============================================================================
+// Stats
+// Build with -DLEX_STATS to count what the hot paths do, otherwise the
+// counters and every update compile out. Counters are per thread and are
+// folded into one total when a pool worker exits or the stats are dumped.
+#ifdef LEX_STATS
+typedef struct {
+    uint64_t nfa_move;          // NFA steps over a whole active set
+    uint64_t nfa_active;        // states active after them
+    uint64_t closure_visit;     // states visited by NFA_eps_closure
+    uint64_t closure_eps;       // eps edges followed
+    uint64_t scan;              // match_scan calls
+    uint64_t backtrack;         // bytes read past the end of the match
+    uint64_t rule_tokens[MAX_CLASS];
+    uint64_t rule_bytes[MAX_CLASS];
+    uint64_t symbol_lookup;
+    uint64_t symbol_probe;      // slots looked at
+    uint64_t dfa_hit;           // lazy DFA transitions found in the cache
+    uint64_t dfa_miss;
+    uint64_t dfa_flush;
+    uint64_t table_step;        // DFA table steps
+    uint64_t table_skip;        // bytes passed by the skip runners
+    // Maxima from here on, the rest are sums
+    uint64_t nfa_active_max;
+    uint64_t backtrack_max;
+    uint64_t symbol_probe_max;
+} Lex_Stats;
+
+__thread Lex_Stats lex_stats;
+Lex_Stats          lex_stats_total;
+pthread_mutex_t    lex_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STAT_ADD(field, n) (lex_stats.field += (n))
+#define STAT_MAX(field, n) do { \
+        uint64_t stat_n = (n); \
+        if (stat_n > lex_stats.field) lex_stats.field = stat_n; \
+    } while (0)
+#define STAT_MERGE()          lex_stats_merge()
+#define STAT_DUMP(out, json)  lex_stats_dump(out, json)
+
+void lex_stats_merge() {
+    uint64_t* total = (uint64_t*)&lex_stats_total;
+    uint64_t* local = (uint64_t*)&lex_stats;
+    uint32_t  idx;
+    pthread_mutex_lock(&lex_stats_lock);
+    for (idx = 0; idx < sizeof(Lex_Stats) / sizeof(uint64_t); ++idx)
+        if (idx < offsetof(Lex_Stats, nfa_active_max) / sizeof(uint64_t))
+            total[idx] += local[idx];
+        else if (local[idx] > total[idx])
+            total[idx] = local[idx];
+    pthread_mutex_unlock(&lex_stats_lock);
+    memset(&lex_stats, 0, sizeof(Lex_Stats));
+}
+
+double lex_stats_avg(uint64_t sum, uint64_t num) {
+    return num? (double)sum / num: 0;
+}
+
+void lex_stats_dump(FILE* out, bool json) {
+    Lex_Stats* stats = &lex_stats_total;
+    uint16_t   class;
+    bool       first = true;
+
+    lex_stats_merge();
+    if (json) {
+        fprintf(out, "{\"bench\": \"stats\", \"nfa_move\": %lu, \"nfa_active_avg\": %.2f, " \
+                "\"nfa_active_max\": %lu, \"closure_visit\": %lu, \"closure_eps\": %lu, " \
+                "\"scan\": %lu, \"backtrack_avg\": %.3f, \"backtrack_max\": %lu, " \
+                "\"symbol_lookup\": %lu, \"symbol_probe_avg\": %.3f, \"symbol_probe_max\": %lu, " \
+                "\"dfa_hit\": %lu, \"dfa_miss\": %lu, \"dfa_flush\": %lu, " \
+                "\"table_step\": %lu, \"table_skip\": %lu, \"rules\": {", \
+                stats->nfa_move, lex_stats_avg(stats->nfa_active, stats->nfa_move), \
+                stats->nfa_active_max, stats->closure_visit, stats->closure_eps, \
+                stats->scan, lex_stats_avg(stats->backtrack, stats->scan), stats->backtrack_max, \
+                stats->symbol_lookup, lex_stats_avg(stats->symbol_probe, stats->symbol_lookup), \
+                stats->symbol_probe_max, stats->dfa_hit, stats->dfa_miss, stats->dfa_flush, \
+                stats->table_step, stats->table_skip);
+        for (class = 0; class < MAX_CLASS; ++class)
+            if (stats->rule_tokens[class]) {
+                fprintf(out, "%s\"%d\": {\"tokens\": %lu, \"bytes\": %lu}", first? "": ", ", \
+                        class, stats->rule_tokens[class], stats->rule_bytes[class]);
+                first = false;
+            }
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "nfa moves   %lu, active avg %.2f max %lu\n", stats->nfa_move, \
+            lex_stats_avg(stats->nfa_active, stats->nfa_move), stats->nfa_active_max);
+    fprintf(out, "closure     %lu visits, %lu eps edges\n", stats->closure_visit, stats->closure_eps);
+    fprintf(out, "scans       %lu, backtrack avg %.3f max %lu bytes\n", stats->scan, \
+            lex_stats_avg(stats->backtrack, stats->scan), stats->backtrack_max);
+    for (class = 0; class < MAX_CLASS; ++class)
+        if (stats->rule_tokens[class])
+            fprintf(out, "rule %-6d %lu tokens, %lu bytes\n", class, \
+                    stats->rule_tokens[class], stats->rule_bytes[class]);
+    fprintf(out, "symbols     %lu lookups, probes avg %.3f max %lu\n", stats->symbol_lookup, \
+            lex_stats_avg(stats->symbol_probe, stats->symbol_lookup), stats->symbol_probe_max);
+    fprintf(out, "lazy dfa    %lu hits, %lu misses, %lu flushes\n", \
+            stats->dfa_hit, stats->dfa_miss, stats->dfa_flush);
+    fprintf(out, "dfa table   %lu steps, %lu bytes skipped\n", stats->table_step, stats->table_skip);
+}
+#else
+#define STAT_ADD(field, n)
+#define STAT_MAX(field, n)
+#define STAT_MERGE()
+#define STAT_DUMP(out, json)
+#endif
+// =============================================================================
 
 // =============================================================================
 // Stack
@@ -62,10 +182,157 @@ void stack_destroy(Stack* stack) {
 }
 // =============================================================================
 
+// =============================================================================
+// Sparse Set
+// Briggs and Torczon, clearing is O(1) and members stay in insertion order
+typedef struct {
+    uint32_t* dense;
+    uint32_t* sparse;
+    uint32_t  count;
+} Sparse_Set;
+
+Sparse_Set* sparse_set_init(uint32_t max_size) {
+    Sparse_Set* set = malloc(sizeof(Sparse_Set));
+    set->dense  = malloc(sizeof(uint32_t) * max_size);
+    set->sparse = calloc(sizeof(uint32_t), max_size);
+    set->count  = 0;
+    return set;
+}
+
+void sparse_set_clear(Sparse_Set* set) {
+    set->count = 0;
+}
+
+bool sparse_set_has(Sparse_Set* set, uint32_t val) {
+    return set->sparse[val] < set->count && set->dense[set->sparse[val]] == val;
+}
+
+void sparse_set_add(Sparse_Set* set, uint32_t val) {
+    if (sparse_set_has(set, val))
+        return;
+    set->sparse[val]         = set->count;
+    set->dense[set->count++] = val;
+}
+
+void sparse_set_destroy(Sparse_Set* set) {
+    free(set->dense);
+    free(set->sparse);
+    free(set);
+}
+// =============================================================================
+
+// =============================================================================
+// Work Pool
+// Tasks are dealt round robin into one deque per worker. A worker takes from
+// the bottom of its own deque and, once empty, steals from the top of the
+// others, so a few large tasks do not leave the rest of the pool idle.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t*       task;
+    uint32_t        top;
+    uint32_t        bottom;
+} Work_Deque;
+
+typedef struct work_pool {
+    Work_Deque* deque;
+    uint16_t    num_workers;
+    void        (*run)(void*, uint16_t, uint32_t);
+    void*       arg;
+} Work_Pool;
+
+typedef struct {
+    Work_Pool* pool;
+    uint16_t   worker;
+} Work_Arg;
+
+bool work_deque_pop(Work_Deque* deque, uint32_t* task) {
+    bool found;
+    pthread_mutex_lock(&deque->lock);
+    found = deque->top < deque->bottom;
+    if (found)
+        *task = deque->task[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+bool work_deque_steal(Work_Deque* deque, uint32_t* task) {
+    bool found;
+    pthread_mutex_lock(&deque->lock);
+    found = deque->top < deque->bottom;
+    if (found)
+        *task = deque->task[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+void* work_pool_worker(void* arg) {
+    Work_Pool* pool   = ((Work_Arg*)arg)->pool;
+    uint16_t   worker = ((Work_Arg*)arg)->worker;
+    uint16_t   victim;
+    uint32_t   task = 0;
+
+    for (;;) {
+        if (!work_deque_pop(pool->deque + worker, &task)) {
+            for (victim = 1; victim < pool->num_workers; ++victim)
+                if (work_deque_steal(pool->deque + (worker + victim) % pool->num_workers, &task))
+                    break;
+            if (victim == pool->num_workers) {
+                STAT_MERGE();
+                return NULL;
+            }
+        }
+        pool->run(pool->arg, worker, task);
+    }
+}
+
+// Run tasks [0, num_tasks) as run(arg, worker, task) on num_workers threads
+void work_pool_run(uint16_t num_workers, uint32_t num_tasks, \
+        void (*run)(void*, uint16_t, uint32_t), void* arg) {
+    Work_Pool  pool;
+    Work_Arg*  work_arg = malloc(sizeof(Work_Arg) * num_workers);
+    pthread_t* thread   = malloc(sizeof(pthread_t) * num_workers);
+    uint32_t   task;
+    uint16_t   worker;
+
+    pool.deque       = calloc(sizeof(Work_Deque), num_workers);
+    pool.num_workers = num_workers;
+    pool.run         = run;
+    pool.arg         = arg;
+    for (worker = 0; worker < num_workers; ++worker) {
+        pthread_mutex_init(&pool.deque[worker].lock, NULL);
+        pool.deque[worker].task = malloc(sizeof(uint32_t) * (num_tasks / num_workers + 1));
+    }
+    for (task = 0; task < num_tasks; ++task) {
+        Work_Deque* deque = pool.deque + task % num_workers;
+        deque->task[deque->bottom++] = num_tasks - 1 - task;
+    }
+
+    for (worker = 0; worker < num_workers; ++worker) {
+        work_arg[worker].pool   = &pool;
+        work_arg[worker].worker = worker;
+        pthread_create(thread + worker, NULL, work_pool_worker, work_arg + worker);
+    }
+    for (worker = 0; worker < num_workers; ++worker)
+        pthread_join(thread[worker], NULL);
+
+    for (worker = 0; worker < num_workers; ++worker) {
+        pthread_mutex_destroy(&pool.deque[worker].lock);
+        free(pool.deque[worker].task);
+    }
+    free(pool.deque);
+    free(work_arg);
+    free(thread);
+}
+// =============================================================================
+
 // =============================================================================
 // Parse Regular Expression
+// Every symbol, escape or bracket class is an OP_SET leaf holding the bytes it
+// matches, so a class costs one edge per run of bytes instead of one per byte.
+// \u and \U expand to the UTF-8 byte sequences of C11 identifier characters.
 typedef struct regnode {
-    char val;
+    char            val;
+    uint64_t*       set;
     struct regnode* left;
     struct regnode* right;
 } Regnode;
@@ -73,16 +340,184 @@ typedef struct regnode {
 Regnode* regnode_init(char val) {
     Regnode* new_node = malloc(sizeof(Regnode));
     new_node->val     = val;
+    new_node->set     = val == OP_SET? calloc(sizeof(uint64_t), SET_WORDS): NULL;
     new_node->left    = NULL;
     new_node->right   = NULL;
     return new_node;
 }
 
+bool set_has(uint64_t* set, uint16_t symbol) {
+    return set[symbol / 64] >> (symbol % 64) & 1;
+}
+
+void set_add(uint64_t* set, uint16_t lo, uint16_t hi) {
+    for (; lo <= hi && lo < NUM_SYMBOLS; ++lo)
+        set[lo / 64] |= 1ULL << (lo % 64);
+}
+
+// Add the bytes of escape \\c, false when c is not a class or control escape
+bool set_add_escape(uint64_t* set, char c) {
+    if (c == 'n')
+        set_add(set, '\n', '\n');
+    else if (c == 't')
+        set_add(set, '\t', '\t');
+    else if (c == 'd')
+        set_add(set, '0', '9');
+    else if (c == 'A')
+        set_add(set, 'A', 'Z');
+    else if (c == 'a')
+        set_add(set, 'a', 'z');
+    else if (c == 'z') {
+        set_add(set, 'A', 'Z');
+        set_add(set, 'a', 'z');
+    }
+    else if (c == 'w') {
+        set_add(set, ' ', ' ');
+        set_add(set, '\n', '\n');
+        set_add(set, '\t', '\t');
+    }
+    else
+        return false;
+    return true;
+}
+
+Regnode* regnode_symbol(char c) {
+    Regnode* node = regnode_init(OP_SET);
+    set_add(node->set, (uint8_t)c, (uint8_t)c);
+    return node;
+}
+
+Regnode* regnode_binary(char val, Regnode* left, Regnode* right) {
+    Regnode* node = regnode_init(val);
+    node->left    = left;
+    node->right   = right;
+    return node;
+}
+
+// C11 Annex D.1, code points allowed in identifiers
+uint32_t utf8_ident[][2] = {
+    {0x00a8, 0x00a8}, {0x00aa, 0x00aa}, {0x00ad, 0x00ad}, {0x00af, 0x00af},
+    {0x00b2, 0x00b5}, {0x00b7, 0x00ba}, {0x00bc, 0x00be}, {0x00c0, 0x00d6},
+    {0x00d8, 0x00f6}, {0x00f8, 0x00ff}, {0x0100, 0x167f}, {0x1681, 0x180d},
+    {0x180f, 0x1fff}, {0x200b, 0x200d}, {0x202a, 0x202e}, {0x203f, 0x2040},
+    {0x2054, 0x2054}, {0x2060, 0x206f}, {0x2070, 0x218f}, {0x2460, 0x24ff},
+    {0x2776, 0x2793}, {0x2c00, 0x2dff}, {0x2e80, 0x2fff}, {0x3004, 0x3007},
+    {0x3021, 0x302f}, {0x3031, 0x303f}, {0x3040, 0xd7ff}, {0xf900, 0xfd3d},
+    {0xfd40, 0xfdcf}, {0xfdf0, 0xfe44}, {0xfe47, 0xfffd}, {0x10000, 0x1fffd},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd}, {0x40000, 0x4fffd}, {0x50000, 0x5fffd},
+    {0x60000, 0x6fffd}, {0x70000, 0x7fffd}, {0x80000, 0x8fffd}, {0x90000, 0x9fffd},
+    {0xa0000, 0xafffd}, {0xb0000, 0xbfffd}, {0xc0000, 0xcfffd}, {0xd0000, 0xdfffd},
+    {0xe0000, 0xefffd},
+};
+
+// C11 Annex D.2, not allowed as the first character
+uint32_t utf8_ident_not_first[][2] = {
+    {0x0300, 0x036f}, {0x1dc0, 0x1dff}, {0x20d0, 0x20ff}, {0xfe20, 0xfe2f},
+};
+
+uint8_t utf8_encode(uint32_t code, uint8_t* byte) {
+    if (code < 0x80) {
+        byte[0] = code;
+        return 1;
+    }
+    if (code < 0x800) {
+        byte[0] = 0xc0 | code >> 6;
+        byte[1] = 0x80 | (code & 0x3f);
+        return 2;
+    }
+    if (code < 0x10000) {
+        byte[0] = 0xe0 | code >> 12;
+        byte[1] = 0x80 | (code >> 6 & 0x3f);
+        byte[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+    byte[0] = 0xf0 | code >> 18;
+    byte[1] = 0x80 | (code >> 12 & 0x3f);
+    byte[2] = 0x80 | (code >> 6 & 0x3f);
+    byte[3] = 0x80 | (code & 0x3f);
+    return 4;
+}
+
+// Add to *tree the alternatives matching the UTF-8 encodings of code points
+// [lo, hi]. The range is split until every byte position of the encodings
+// spans one contiguous byte range, each piece is a chain of OP_SET leaves.
+void utf8_range(Regnode** tree, uint32_t lo, uint32_t hi) {
+    uint32_t border[] = {0x7f, 0x7ff, 0xffff};
+    uint8_t  byte_lo[4];
+    uint8_t  byte_hi[4];
+    uint8_t  len;
+    uint8_t  idx;
+    uint32_t mask;
+    Regnode* seq = NULL;
+    Regnode* node;
+
+    for (idx = 0; idx < 3; ++idx)
+        if (lo <= border[idx] && hi > border[idx]) {
+            utf8_range(tree, lo, border[idx]);
+            utf8_range(tree, border[idx] + 1, hi);
+            return;
+        }
+    len = utf8_encode(lo, byte_lo);
+    for (idx = 1; idx < len; ++idx) {
+        mask = (1u << (6 * idx)) - 1;
+        if ((lo & ~mask) == (hi & ~mask))
+            continue;
+        if (lo & mask) {
+            utf8_range(tree, lo, lo | mask);
+            utf8_range(tree, (lo | mask) + 1, hi);
+            return;
+        }
+        if ((hi & mask) != mask) {
+            utf8_range(tree, lo, (hi & ~mask) - 1);
+            utf8_range(tree, hi & ~mask, hi);
+            return;
+        }
+    }
+
+    utf8_encode(hi, byte_hi);
+    for (idx = len; idx > 0; --idx) {
+        node = regnode_init(OP_SET);
+        set_add(node->set, byte_lo[idx - 1], byte_hi[idx - 1]);
+        seq  = seq? regnode_binary(OP_CON, node, seq): node;
+    }
+    *tree = *tree? regnode_binary(OP_UNI, *tree, seq): seq;
+}
+
+// UTF-8 encoded identifier characters of C11 beyond ASCII, first for \u and
+// any for \U
+Regnode* regnode_utf8_ident(bool first) {
+    Regnode* tree = NULL;
+    uint32_t lo;
+    uint32_t hi;
+    uint16_t idx;
+    uint16_t cut;
+
+    for (idx = 0; idx < sizeof(utf8_ident) / sizeof(utf8_ident[0]); ++idx) {
+        lo = utf8_ident[idx][0];
+        hi = utf8_ident[idx][1];
+        for (cut = 0; first && cut < sizeof(utf8_ident_not_first) / sizeof(utf8_ident_not_first[0]); ++cut)
+            if (utf8_ident_not_first[cut][0] >= lo && utf8_ident_not_first[cut][1] <= hi) {
+                if (utf8_ident_not_first[cut][0] > lo)
+                    utf8_range(&tree, lo, utf8_ident_not_first[cut][0] - 1);
+                lo = utf8_ident_not_first[cut][1] + 1;
+            }
+        if (lo <= hi)
+            utf8_range(&tree, lo, hi);
+    }
+    return tree;
+}
+
 void regnode_print(Regnode* root) {
+    uint16_t symbol;
     if (!root)
         return;
-    if (isprint(root->val))
-        printf("%c", root->val);
+    if (root->val == OP_SET) {
+        printf("[");
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+            if (set_has(root->set, symbol))
+                printf(isprint(symbol)? "%c": "\\x%02x", symbol);
+        printf("]");
+    }
     else
         printf("[%02d]", root->val);
     regnode_print(root->left);
@@ -116,6 +551,7 @@ void regnode_destroy(Regnode* root) {
         regnode_destroy(root->left);
     if (root->right)
         regnode_destroy(root->right);
+    free(root->set);
     free(root);
 }
 
@@ -147,6 +583,108 @@ void push_regnode(char val, Stack* stack_node) {
     stack_push(stack_node, node1);
 }
 
+// node{min,max}, max is MAX_REPEAT + 1 when unbounded. The copies share node,
+// as the tree of a + already does.
+Regnode* regnode_repeat(Regnode* node, uint16_t min, uint16_t max) {
+    Regnode* tail = NULL;
+    uint16_t idx;
+
+    if (max > MAX_REPEAT) {
+        tail       = regnode_init(OP_STAR);
+        tail->left = node;
+    }
+    else
+        // x{0,k} = (x(x(...)?)?)?
+        for (idx = min; idx < max; ++idx)
+            tail = regnode_binary(OP_UNI, regnode_init(OP_EPS), \
+                                  tail? regnode_binary(OP_CON, node, tail): node);
+    for (idx = 0; idx < min; ++idx)
+        tail = tail? regnode_binary(OP_CON, node, tail): node;
+    if (!tail) {
+        // x{0} matches only the empty string, node is not kept
+        regnode_destroy(node);
+        tail = regnode_init(OP_EPS);
+    }
+    return tail;
+}
+
+// Parse "{m}", "{m,}" or "{m,n}" at str, returns its length or 0 when str
+// does not start a count, which then reads as a literal '{'
+uint16_t regexp_count(char* str, uint16_t* min, uint16_t* max) {
+    char*         end  = str + 1;
+    bool          open = false;
+    unsigned long lo;
+    unsigned long hi;
+    if (!isdigit(*end))
+        return 0;
+    lo = strtoul(end, &end, 10);
+    hi = lo;
+    if (*end == ',') {
+        ++end;
+        if (isdigit(*end))
+            hi = strtoul(end, &end, 10);
+        else
+            open = true;
+    }
+    if (*end != '}')
+        return 0;
+    // Bounds are checked before narrowing, MAX_REPEAT is below UINT16_MAX
+    if (lo > MAX_REPEAT || (!open && (hi > MAX_REPEAT || lo > hi))) {
+        printf("Bad repetition %.*s\n", (int)(end - str + 1), str);
+        exit(-1);
+    }
+    *min = lo;
+    *max = open? MAX_REPEAT + 1: hi;
+    return end - str + 1;
+}
+
+// Parse "[...]" at str into an OP_SET node, returns its length. Ranges a-z,
+// escapes and a leading ^ for the complement are understood.
+uint16_t regexp_class(char* str, Regnode** node) {
+    uint64_t set[SET_WORDS] = {0};
+    uint16_t idx            = 1;
+    uint16_t word;
+    bool     negate         = str[idx] == '^';
+    uint8_t  lo;
+    uint8_t  hi;
+
+    *node = regnode_init(OP_SET);
+    if (negate)
+        ++idx;
+    // A ']' first is a member, not the end
+    for (bool first = true; str[idx] && (first || str[idx] != ']'); first = false) {
+        if (str[idx] == '\\' && (str[idx + 1] == 'u' || str[idx + 1] == 'U')) {
+            printf("No UTF-8 escapes in a class %s\n", str);
+            exit(-1);
+        }
+        if (str[idx] == '\\' && str[idx + 1] && set_add_escape(set, str[idx + 1])) {
+            idx += 2;
+            continue;
+        }
+        if (str[idx] == '\\' && str[idx + 1])
+            ++idx;
+        lo = hi = str[idx++];
+        if (str[idx] == '-' && str[idx + 1] && str[idx + 1] != ']') {
+            hi   = str[idx + 1] == '\\' && str[idx + 2]? str[idx + 2]: str[idx + 1];
+            idx += str[idx + 1] == '\\'? 3: 2;
+            if (lo > hi) {
+                printf("Bad class range %c-%c\n", lo, hi);
+                exit(-1);
+            }
+        }
+        set_add(set, lo, hi);
+    }
+    if (str[idx] != ']') {
+        printf("Unterminated class %s\n", str);
+        exit(-1);
+    }
+    if (negate)
+        set[0] |= 1;  // keep byte 0 out of the complement
+    for (word = 0; word < SET_WORDS; ++word)
+        (*node)->set[word] = negate? ~set[word]: set[word];
+    return idx + 1;
+}
+
 Regnode* regexp_to_regnode(char* regexp) {
     Stack*   stack_op        = stack_init(strlen(regexp) * 2);
     Stack*   stack_node      = stack_init(strlen(regexp) * 2);
@@ -154,16 +692,28 @@ Regnode* regexp_to_regnode(char* regexp) {
     char     op_con          = OP_CON;
     char     op_uni          = OP_UNI;
     bool     pre_symbol_term = false;
+    uint16_t count_len;
+    uint16_t min;
+    uint16_t max;
+    Regnode* node;
 
 
     if (strlen(regexp) > MAX_REG_LEN) {
         printf("Regexp tooooo long\n");
         exit(-1);
     }
+    if (!*regexp) {
+        printf("Empty regexp\n");
+        exit(-1);
+    }
 
     for (regexp_idx = 0; regexp_idx < strlen(regexp); ++regexp_idx) { 
+        // A count repeats the atom before it, without one '{' is a literal
+        count_len = regexp[regexp_idx] == '{' && pre_symbol_term? \
+                    regexp_count(regexp + regexp_idx, &min, &max): 0;
+
         // Add omit concat
-        if (pre_symbol_term && !strchr(")*?+|", regexp[regexp_idx]))
+        if (pre_symbol_term && !strchr(")*?+|", regexp[regexp_idx]) && !count_len)
             stack_push(stack_op, &op_con);
 
         // Parse
@@ -173,59 +723,88 @@ Regnode* regexp_to_regnode(char* regexp) {
                 stack_push(stack_op, regexp + regexp_idx);
                 break;
             case ')':
-                pre_symbol_term = true;
-                while (*(char*)stack_top(stack_op) != '(')
+                while (stack_len(stack_op) && *(char*)stack_top(stack_op) != '(')
                     push_regnode(*(char*)stack_pop(stack_op), stack_node);
+                if (!pre_symbol_term || !stack_len(stack_op)) {
+                    printf("Unbalanced or empty group in regexp %s\n", regexp);
+                    exit(-1);
+                }
+                pre_symbol_term = true;
                 stack_pop(stack_op); // pop '('
                 break;
             case '*':
-                pre_symbol_term = true;
-                push_regnode(OP_STAR, stack_node);
-                break;
             case '+':
-                pre_symbol_term = true;
-                push_regnode(OP_PLUS, stack_node);
-                break;
             case '?':
-                pre_symbol_term = true;
-                push_regnode(OP_QUES, stack_node);
+                if (!pre_symbol_term) {
+                    printf("Nothing to repeat in regexp %s\n", regexp);
+                    exit(-1);
+                }
+                push_regnode(regexp[regexp_idx] == '*'? OP_STAR: \
+                             regexp[regexp_idx] == '+'? OP_PLUS: OP_QUES, stack_node);
                 break;
             case '|':
+                if (!pre_symbol_term) {
+                    printf("Empty alternative in regexp %s\n", regexp);
+                    exit(-1);
+                }
                 pre_symbol_term = false;
                 while (stack_len(stack_op) && *(char*)stack_top(stack_op) == OP_CON)
                     push_regnode(*(char*)stack_pop(stack_op), stack_node);
                 stack_push(stack_op, &op_uni);
                 break;
+            case '[':
+                pre_symbol_term = true;
+                regexp_idx     += regexp_class(regexp + regexp_idx, &node) - 1;
+                stack_push(stack_node, node);
+                break;
             case '\\':
+                if (!regexp[regexp_idx + 1]) {
+                    printf("Trailing \\ in regexp %s\n", regexp);
+                    exit(-1);
+                }
                 pre_symbol_term = true;
                 regexp_idx++;
-                if (regexp[regexp_idx] == 'e')
-                    push_regnode(OP_EPS, stack_node);
-                else if (regexp[regexp_idx] == 'n')
-                    push_regnode('\n', stack_node);
-                else if (regexp[regexp_idx] == 'd')
-                    push_regnode(OP_DIG, stack_node);
-                else if (regexp[regexp_idx] == 'A')
-                    push_regnode(OP_AZ, stack_node);
-                else if (regexp[regexp_idx] == 'a')
-                    push_regnode(OP_az, stack_node);
-                else if (regexp[regexp_idx] == 'z')
-                    push_regnode(OP_Az, stack_node);
-                else if (regexp[regexp_idx] == 'w')
-                    push_regnode(OP_W, stack_node);
-                else
-                    push_regnode(regexp[regexp_idx], stack_node);
+                node = regnode_init(OP_SET);
+                if (regexp[regexp_idx] == 'e' || regexp[regexp_idx] == 'u' || regexp[regexp_idx] == 'U') {
+                    regnode_destroy(node);
+                    node = regexp[regexp_idx] == 'e'? regnode_init(OP_EPS): \
+                           regnode_utf8_ident(regexp[regexp_idx] == 'u');
+                }
+                else if (!set_add_escape(node->set, regexp[regexp_idx]))
+                    set_add(node->set, (uint8_t)regexp[regexp_idx], (uint8_t)regexp[regexp_idx]);
+                stack_push(stack_node, node);
+                break;
+            case '{':
+                pre_symbol_term = true;
+                if (count_len) {
+                    regexp_idx += count_len - 1;
+                    stack_push(stack_node, regnode_repeat(stack_pop(stack_node), min, max));
+                    break;
+                }
+                stack_push(stack_node, regnode_symbol('{'));
                 break;
             default:
                 pre_symbol_term = true;
-                push_regnode(regexp[regexp_idx], stack_node);
+                stack_push(stack_node, regnode_symbol(regexp[regexp_idx]));
         }
     }
 
-    while (stack_len(stack_op))
+    // Every group is closed and the last alternative is not empty
+    if (!pre_symbol_term) {
+        printf("Incomplete regexp %s\n", regexp);
+        exit(-1);
+    }
+    while (stack_len(stack_op)) {
+        if (*(char*)stack_top(stack_op) == '(') {
+            printf("Unbalanced or empty group in regexp %s\n", regexp);
+            exit(-1);
+        }
         push_regnode(*(char*)stack_pop(stack_op), stack_node);
-    printf("Parse regexp done, remain op = %d. remain node = %d\n", \
-           stack_len(stack_op), stack_len(stack_node));
+    }
+#ifdef LEX_STATS
+    fprintf(stderr, "Parse regexp done, remain op = %d. remain node = %d\n", \
+            stack_len(stack_op), stack_len(stack_node));
+#endif
     Regnode* root = stack_top(stack_node);
     stack_destroy(stack_op);
     stack_destroy(stack_node);
@@ -235,494 +814,3626 @@ Regnode* regexp_to_regnode(char* regexp) {
 
 // =============================================================================
 // NFA
-typedef struct trans {
-    void*         des[TRANS_ENTRY_PER_RECORD];
-    struct trans* next;
-} Trans;
-
-typedef struct state {
-    Trans*        trans[NUM_SYMBOLS];
-    uint16_t      final_status;
-    bool          select_now;
-    bool          select_tmp;
-    struct state* next;
-} State;
-
-Trans* trans_init() {
-    Trans* trans = malloc(sizeof(Trans));
-    memset(trans->des, 0, sizeof(void*) * TRANS_ENTRY_PER_RECORD);
-    trans->next = NULL;
-    return trans;
-}
-
-Trans* trans_add_des(Trans* trans, State* des) {
-    uint16_t count;
-    if (!trans) {
-        trans         = trans_init();
-        trans->des[0] = des;
-        return trans;
-    }
-    for (count = 0; count < TRANS_ENTRY_PER_RECORD; ++count) {
-        if (trans->des[count] == des)
-            return trans;
-        else if (!trans->des[count]) {
-            trans->des[count] = des;
-            return trans;
-        }
-    }
-    trans->next = trans_add_des(trans->next, des);
-    return trans;
+// Built as edge lists, then packed into CSR arrays. States are indices and
+// state 0 is the start state shared by all rules.
+typedef struct {
+    uint32_t des;
+    uint8_t  lo;
+    uint8_t  hi;
+} Range;
+
+typedef struct {
+    uint32_t src;
+    uint32_t des;
+    uint8_t  lo;
+    uint8_t  hi;
+} Edge;
+
+typedef struct {
+    uint16_t* final_status;
+    uint32_t  num_states;
+    uint32_t  cap_states;
+    Edge*     edge;
+    uint32_t  num_edges;
+    uint32_t  cap_edges;
+} NFA_Builder;
+
+typedef struct {
+    uint32_t start;
+    uint32_t first;
+    uint32_t last;
+} Fragment;
+
+typedef struct {
+    uint32_t  num_states;
+    uint32_t* range_pos;
+    Range*    range;
+    uint32_t* eps_pos;
+    uint32_t* eps;
+    uint16_t* final_status;
+} NFA;
+
+NFA_Builder* nfa_builder_init() {
+    NFA_Builder* builder  = malloc(sizeof(NFA_Builder));
+    builder->num_states   = 0;
+    builder->cap_states   = 64;
+    builder->final_status = malloc(sizeof(uint16_t) * builder->cap_states);
+    builder->num_edges    = 0;
+    builder->cap_edges    = 64;
+    builder->edge         = malloc(sizeof(Edge) * builder->cap_edges);
+    return builder;
 }
 
-void trans_add(State* src, char symbol, State* des) {
-    src->trans[symbol] = trans_add_des(src->trans[symbol], des);
+void nfa_builder_destroy(NFA_Builder* builder) {
+    free(builder->final_status);
+    free(builder->edge);
+    free(builder);
 }
 
-void trans_destroy(Trans* trans) {
-    if (!trans)
-        return;
-    trans_destroy(trans->next);
-    free(trans);
+uint32_t state_add(NFA_Builder* builder, uint16_t final_status) {
+    if (builder->num_states == builder->cap_states) {
+        builder->cap_states  *= 2;
+        builder->final_status = realloc(builder->final_status, sizeof(uint16_t) * builder->cap_states);
+    }
+    builder->final_status[builder->num_states] = final_status;
+    return builder->num_states++;
 }
 
-State* state_init(uint16_t final_status, State* next) {
-    State* state        = malloc(sizeof(State));
-    state->final_status = final_status;
-    state->next         = next;
-    memset(state->trans, 0, sizeof(Trans*) * NUM_SYMBOLS);
-    return state;
+// An edge with lo > hi is an epsilon edge
+void edge_add(NFA_Builder* builder, uint32_t src, uint8_t lo, uint8_t hi, uint32_t des) {
+    Edge* edge;
+    if (builder->num_edges == builder->cap_edges) {
+        builder->cap_edges *= 2;
+        builder->edge       = realloc(builder->edge, sizeof(Edge) * builder->cap_edges);
+    }
+    edge      = builder->edge + builder->num_edges++;
+    edge->src = src;
+    edge->des = des;
+    edge->lo  = lo;
+    edge->hi  = hi;
 }
 
-void state_append(State* src, State* des) {
-    if (src->next)
-        state_append(src->next, des);
-    else
-        src->next = des;
+void eps_add(NFA_Builder* builder, uint32_t src, uint32_t des) {
+    edge_add(builder, src, 1, 0, des);
 }
 
-void state_clean_select(State* src) {
-    if (src) {
-        src->select_tmp = false;
-        state_clean_select(src->next);
-    }
+int range_cmp(const void* a, const void* b) {
+    Range* ra = (Range*)a;
+    Range* rb = (Range*)b;
+    if (ra->lo != rb->lo)
+        return ra->lo - rb->lo;
+    if (ra->hi != rb->hi)
+        return ra->hi - rb->hi;
+    return (ra->des > rb->des) - (ra->des < rb->des);
 }
 
-void state_copy_select(State* src) {
-    if (src) {
-        src->select_now = src->select_tmp;
-        state_copy_select(src->next);
+// Pack the builder into one allocation, ranges of a state sorted by lo with
+// duplicates dropped
+NFA* nfa_compile(NFA_Builder* builder) {
+    uint32_t num_states = builder->num_states;
+    uint32_t num_ranges = 0;
+    uint32_t num_eps    = 0;
+    uint32_t state;
+    uint32_t begin;
+    uint32_t idx;
+    uint32_t pos;
+    Edge*    edge;
+    NFA*     nfa;
+    char*    block;
+
+    for (idx = 0; idx < builder->num_edges; ++idx)
+        if (builder->edge[idx].lo > builder->edge[idx].hi)
+            ++num_eps;
+        else
+            ++num_ranges;
+
+    block = calloc(1, sizeof(NFA) + \
+                      sizeof(Range)    * num_ranges + \
+                      sizeof(uint32_t) * (num_eps + 2 * (num_states + 1)) + \
+                      sizeof(uint16_t) * num_states);
+    nfa               = (NFA*)block;
+    nfa->num_states   = num_states;
+    nfa->range        = (Range*)(block + sizeof(NFA));
+    nfa->range_pos    = (uint32_t*)(nfa->range + num_ranges);
+    nfa->eps_pos      = nfa->range_pos + num_states + 1;
+    nfa->eps          = nfa->eps_pos + num_states + 1;
+    nfa->final_status = (uint16_t*)(nfa->eps + num_eps);
+    memcpy(nfa->final_status, builder->final_status, sizeof(uint16_t) * num_states);
+
+    // Counting sort by source state
+    for (idx = 0; idx < builder->num_edges; ++idx) {
+        edge = builder->edge + idx;
+        if (edge->lo > edge->hi)
+            ++nfa->eps_pos[edge->src + 1];
+        else
+            ++nfa->range_pos[edge->src + 1];
+    }
+    for (state = 0; state < num_states; ++state) {
+        nfa->eps_pos[state + 1]   += nfa->eps_pos[state];
+        nfa->range_pos[state + 1] += nfa->range_pos[state];
+    }
+    for (idx = 0; idx < builder->num_edges; ++idx) {
+        edge = builder->edge + idx;
+        if (edge->lo > edge->hi)
+            nfa->eps[nfa->eps_pos[edge->src]++] = edge->des;
+        else {
+            nfa->range[nfa->range_pos[edge->src]].des = edge->des;
+            nfa->range[nfa->range_pos[edge->src]].lo  = edge->lo;
+            nfa->range[nfa->range_pos[edge->src]].hi  = edge->hi;
+            ++nfa->range_pos[edge->src];
+        }
+    }
+    for (state = num_states; state > 0; --state) {
+        nfa->eps_pos[state]   = nfa->eps_pos[state - 1];
+        nfa->range_pos[state] = nfa->range_pos[state - 1];
+    }
+    nfa->eps_pos[0]   = 0;
+    nfa->range_pos[0] = 0;
+    for (state = 0, pos = 0; state < num_states; ++state) {
+        begin = nfa->range_pos[state];
+        qsort(nfa->range + begin, nfa->range_pos[state + 1] - begin, sizeof(Range), range_cmp);
+        nfa->range_pos[state] = pos;
+        for (idx = begin; idx < nfa->range_pos[state + 1]; ++idx)
+            if (pos == nfa->range_pos[state] || range_cmp(nfa->range + idx, nfa->range + pos - 1))
+                nfa->range[pos++] = nfa->range[idx];
     }
+    nfa->range_pos[num_states] = pos;
+    return nfa;
 }
 
-void state_destroy(State* src) {
-    uint16_t symbol;
-    if (src) {
-        for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol)
-            trans_destroy(src->trans[symbol]);
-        state_destroy(src->next);
-        free(src);
-    }
+void nfa_destroy(NFA* nfa) {
+    free(nfa);
 }
 
-void print_nfa(State* state) {
-    uint16_t symbol;
-    uint16_t idx;
-    Trans* trans;
+void print_nfa(NFA* nfa) {
+    uint32_t state;
+    uint32_t idx;
     printf("================================\n");
-    for (; state; state = state->next) {
-        printf("%2d %p:\n", state->final_status, state);
-        for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol) {
-            if (!state->trans[symbol])
-                continue;
-            printf("\t%c: ", symbol? symbol: ' ');
-            for (trans = state->trans[symbol]; trans; trans = trans->next)
-                for (idx = 0; (idx < TRANS_ENTRY_PER_RECORD) && (trans->des[idx]); ++idx)
-                    printf("%p ", trans->des[idx]);
+    for (state = 0; state < nfa->num_states; ++state) {
+        printf("%2d %4d:\n", nfa->final_status[state], state);
+        for (idx = nfa->range_pos[state]; idx < nfa->range_pos[state + 1]; ++idx)
+            printf("\t%c-%c: %d\n", nfa->range[idx].lo, nfa->range[idx].hi, nfa->range[idx].des);
+        if (nfa->eps_pos[state] < nfa->eps_pos[state + 1]) {
+            printf("\t  : ");
+            for (idx = nfa->eps_pos[state]; idx < nfa->eps_pos[state + 1]; ++idx)
+                printf("%d ", nfa->eps[idx]);
             printf("\n");
         }
     }
 }
 
-State* regnode_to_nfa(Regnode* root, uint16_t final_status) {
-    uint16_t count;
+// Fragments own the contiguous states [first, last)
+Fragment regnode_to_nfa(NFA_Builder* builder, Regnode* root, uint16_t final_status) {
+    Fragment frag;
+    uint32_t state;
     if (root->val == OP_STAR) {
-        State* nfa         = regnode_to_nfa(root->left, final_status);
-        State* final_state = state_init(final_status, nfa);
-        State* init_state  = state_init(0, final_state);
-        State* state;
-        trans_add(init_state, EPS, nfa);
-        trans_add(init_state, EPS, final_state);
-        for (state = nfa; state; state = state->next)
-            if (state->final_status) {
-                state->final_status = 0;
-                trans_add(state, EPS, nfa);
-                trans_add(state, EPS, final_state);
+        Fragment nfa         = regnode_to_nfa(builder, root->left, final_status);
+        uint32_t final_state = state_add(builder, final_status);
+        uint32_t init_state  = state_add(builder, 0);
+        eps_add(builder, init_state, nfa.start);
+        eps_add(builder, init_state, final_state);
+        for (state = nfa.first; state < nfa.last; ++state)
+            if (builder->final_status[state]) {
+                builder->final_status[state] = 0;
+                eps_add(builder, state, nfa.start);
+                eps_add(builder, state, final_state);
             }
-        return init_state;
+        frag.start = init_state;
+        frag.first = nfa.first;
     }
     else if (root->val == OP_UNI) {
-        State* nfa1        = regnode_to_nfa(root->left, final_status);
-        State* nfa2        = regnode_to_nfa(root->right, final_status);
-        State* init_state  = state_init(0, nfa1);
-        state_append(init_state, nfa2);
-        trans_add(init_state, EPS, nfa1);
-        trans_add(init_state, EPS, nfa2);
-        return init_state;
+        Fragment nfa1       = regnode_to_nfa(builder, root->left, final_status);
+        Fragment nfa2       = regnode_to_nfa(builder, root->right, final_status);
+        uint32_t init_state = state_add(builder, 0);
+        eps_add(builder, init_state, nfa1.start);
+        eps_add(builder, init_state, nfa2.start);
+        frag.start = init_state;
+        frag.first = nfa1.first;
     }
     else if (root->val == OP_CON) {
-        State* nfa1  = regnode_to_nfa(root->left, final_status);
-        State* nfa2  = regnode_to_nfa(root->right, final_status);
-        State* state;
-        for (state = nfa1; state; state = state->next)
-            if (state->final_status) {
-                state->final_status = 0;
-                trans_add(state, EPS, nfa2);
+        Fragment nfa1 = regnode_to_nfa(builder, root->left, final_status);
+        Fragment nfa2 = regnode_to_nfa(builder, root->right, final_status);
+        for (state = nfa1.first; state < nfa1.last; ++state)
+            if (builder->final_status[state]) {
+                builder->final_status[state] = 0;
+                eps_add(builder, state, nfa2.start);
             }
-        state_append(nfa1, nfa2);
-        return nfa1;
+        frag.start = nfa1.start;
+        frag.first = nfa1.first;
     }
     else if (root->val == OP_EPS) {
-        State* init_state = state_init(final_status, NULL);
-        return init_state;
+        frag.start = state_add(builder, final_status);
+        frag.first = frag.start;
     }
     else {
-        State* final_state = state_init(final_status, NULL);
-        State* init_state  = state_init(0, final_state);
-        char symbol;
-        if (root->val == OP_DIG)
-            for (symbol = '0'; symbol <= '9'; ++symbol)
-                trans_add(init_state, symbol, final_state);
-        else if (root->val == OP_AZ)
-            for (symbol = 'A'; symbol <= 'Z'; ++symbol)
-                trans_add(init_state, symbol, final_state);
-        else if (root->val == OP_az)
-            for (symbol = 'a'; symbol <= 'z'; ++symbol)
-                trans_add(init_state, symbol, final_state);
-        else if (root->val == OP_Az) {
-            for (symbol = 'A'; symbol <= 'Z'; ++symbol)
-                trans_add(init_state, symbol, final_state);
-            for (symbol = 'a'; symbol <= 'z'; ++symbol)
-                trans_add(init_state, symbol, final_state);
-        }
-        else if (root->val == OP_W) {
-            trans_add(init_state, ' ',  final_state);
-            trans_add(init_state, '\n', final_state);
-            trans_add(init_state, '\t', final_state);
+        uint32_t final_state = state_add(builder, final_status);
+        uint32_t init_state  = state_add(builder, 0);
+        uint16_t lo;
+        uint16_t hi;
+        // One edge per run of bytes in the set
+        for (lo = 1; lo < NUM_SYMBOLS; lo = hi + 1) {
+            for (; lo < NUM_SYMBOLS && !set_has(root->set, lo); ++lo);
+            for (hi = lo; hi + 1 < NUM_SYMBOLS && set_has(root->set, hi + 1); ++hi);
+            if (lo < NUM_SYMBOLS)
+                edge_add(builder, init_state, lo, hi, final_state);
         }
-        else
-            trans_add(init_state, root->val, final_state);
-        return init_state;
+        frag.start = init_state;
+        frag.first = final_state;
     }
+    frag.last = builder->num_states;
+    return frag;
 }
 
-void state_eps_closure(State* state, uint16_t* select_count, uint16_t* final_status) {
-    Trans* trans;
-    uint16_t count;
+// A rule that is an alternation of plain strings, such as the operators, is
+// built as a trie instead: the strings share their prefixes and no epsilon
+// edge is needed past the start. Matching is anchored at the token start, so
+// the longest string is found in one walk without Aho-Corasick failure links.
+typedef struct {
+    uint8_t* text;
+    uint16_t len;
+} Literal;
 
-    if (state->select_tmp)
-        return;
-    state->select_tmp = true;
-    ++(*select_count);
-    if (state->final_status > (*final_status))
-        (*final_status) = state->final_status;
-
-    for (trans = state->trans[EPS]; trans; trans = trans->next)
-        for (count = 0; \
-                (count < TRANS_ENTRY_PER_RECORD) && (trans->des[count]); ++count)
-            if (!((State*)trans->des[count])->select_tmp)
-                state_eps_closure(trans->des[count], select_count, final_status);
-}
-
-void NFA_eps_closure(State* NFA, uint16_t* select_count, uint16_t* final_status) {
-    State* state;
-    state_clean_select(NFA);
-    *select_count = 0;
-    *final_status = 0;
-    for (state = NFA; state; state = state->next)
-        if (state->select_now)
-            state_eps_closure(state, select_count, final_status);
-    state_copy_select(NFA);
+typedef struct {
+    Literal  literal[MAX_REG_LEN];
+    uint8_t  text[MAX_REG_LEN];
+    uint16_t num_literals;
+    uint16_t num_bytes;
+} Literal_Set;
+
+// The only byte of set, -1 when it has none or several
+int16_t set_single(uint64_t* set) {
+    int16_t  byte = -1;
+    uint16_t symbol;
+    for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+        if (set_has(set, symbol)) {
+            if (byte >= 0)
+                return -1;
+            byte = symbol;
+        }
+    return byte;
 }
 
-void NFA_move(State* NFA, uint16_t* select_count, uint16_t* final_status, char symbol) {
-    State* state;
-    Trans* trans;
-    uint16_t count;
-    state_clean_select(NFA);
-    for (state = NFA; state; state = state->next)
-        for (trans = state->trans[symbol]; state->select_now && trans; trans = trans->next)
-            for (count = 0; \
-                    (count < TRANS_ENTRY_PER_RECORD) && (trans->des[count]); ++count)
-                ((State*)trans->des[count])->select_tmp = true;
-    state_copy_select(NFA);
-    NFA_eps_closure(NFA, select_count, final_status);
-}
-
-void NFA_init(State* NFA, uint16_t* select_count, uint16_t* final_status) {
-    state_clean_select(NFA);
-    *select_count = 0;
-    *final_status = 0;
-    state_eps_closure(NFA, select_count, final_status);
-    state_copy_select(NFA);
+// Append the string node spells, false when it is not a plain string
+bool regnode_literal(Regnode* node, Literal_Set* set) {
+    int16_t byte;
+    if (node->val == OP_CON)
+        return regnode_literal(node->left, set) && regnode_literal(node->right, set);
+    if (node->val != OP_SET || (byte = set_single(node->set)) < 0 || set->num_bytes == MAX_REG_LEN)
+        return false;
+    set->text[set->num_bytes++] = byte;
+    return true;
+}
+
+// Collect the strings of an alternation, false when some branch is not one
+bool regnode_literals(Regnode* root, Literal_Set* set) {
+    uint16_t begin = set->num_bytes;
+    if (root->val == OP_UNI)
+        return regnode_literals(root->left, set) && regnode_literals(root->right, set);
+    if (!regnode_literal(root, set))
+        return false;
+    set->literal[set->num_literals].text = set->text + begin;
+    set->literal[set->num_literals].len  = set->num_bytes - begin;
+    ++set->num_literals;
+    return true;
+}
+
+int literal_cmp(const void* a, const void* b) {
+    Literal* la  = (Literal*)a;
+    Literal* lb  = (Literal*)b;
+    int      cmp = memcmp(la->text, lb->text, la->len < lb->len? la->len: lb->len);
+    return cmp? cmp: la->len - lb->len;
+}
+
+// Sorted, every string shares the path of its common prefix with the one
+// before it
+Fragment literals_to_nfa(NFA_Builder* builder, Literal_Set* set, uint16_t final_status) {
+    uint32_t path[MAX_REG_LEN + 1];
+    Literal* prev = NULL;
+    Literal* literal;
+    Fragment frag;
+    uint16_t common;
+    uint16_t pos;
+    uint16_t idx;
+
+    qsort(set->literal, set->num_literals, sizeof(Literal), literal_cmp);
+    path[0] = state_add(builder, 0);
+    for (idx = 0; idx < set->num_literals; ++idx) {
+        literal = set->literal + idx;
+        for (common = 0; prev && common < prev->len && common < literal->len && \
+                prev->text[common] == literal->text[common]; ++common);
+        for (pos = common; pos < literal->len; ++pos) {
+            path[pos + 1] = state_add(builder, 0);
+            edge_add(builder, path[pos], literal->text[pos], literal->text[pos], path[pos + 1]);
+        }
+        builder->final_status[path[literal->len]] = final_status;
+        prev = literal;
+    }
+    frag.start = path[0];
+    frag.first = path[0];
+    frag.last  = builder->num_states;
+    return frag;
+}
+
+// Close the set under epsilon edges, the set doubles as the work list
+uint16_t NFA_eps_closure(NFA* nfa, Sparse_Set* set) {
+    uint16_t final_status = 0;
+    uint32_t state;
+    uint32_t idx;
+    uint32_t pos;
+    for (idx = 0; idx < set->count; ++idx) {
+        state = set->dense[idx];
+        if (nfa->final_status[state] > final_status)
+            final_status = nfa->final_status[state];
+        STAT_ADD(closure_eps, nfa->eps_pos[state + 1] - nfa->eps_pos[state]);
+        for (pos = nfa->eps_pos[state]; pos < nfa->eps_pos[state + 1]; ++pos)
+            sparse_set_add(set, nfa->eps[pos]);
+    }
+    STAT_ADD(closure_visit, set->count);
+    return final_status;
+}
+
+void NFA_successor(NFA* nfa, uint32_t state, uint8_t symbol, Sparse_Set* next) {
+    uint32_t pos;
+    for (pos = nfa->range_pos[state]; pos < nfa->range_pos[state + 1]; ++pos) {
+        if (nfa->range[pos].lo > symbol)
+            break;
+        if (symbol <= nfa->range[pos].hi)
+            sparse_set_add(next, nfa->range[pos].des);
+    }
 }
 
-void NFA_run(State* NFA, char* str) {
-    uint16_t str_pt;
-    uint16_t select_count;
+uint16_t NFA_move(NFA* nfa, Sparse_Set* now, Sparse_Set* next, uint8_t symbol) {
     uint16_t final_status;
-    State* state;
-    NFA_init(NFA, &select_count, &final_status);
+    uint32_t idx;
+    sparse_set_clear(next);
+    for (idx = 0; idx < now->count; ++idx)
+        NFA_successor(nfa, now->dense[idx], symbol, next);
+    final_status = NFA_eps_closure(nfa, next);
+    STAT_ADD(nfa_move, 1);
+    STAT_ADD(nfa_active, next->count);
+    STAT_MAX(nfa_active_max, next->count);
+    return final_status;
+}
+
+uint16_t NFA_init(NFA* nfa, Sparse_Set* now) {
+    sparse_set_clear(now);
+    sparse_set_add(now, 0);
+    return NFA_eps_closure(nfa, now);
+}
+
+// Fold every epsilon closure into its state: the state accepts what the
+// closure accepts and owns all range edges leaving it. States entered only
+// through epsilon edges become unreachable and are dropped, state 0 stays
+// the start state.
+NFA* nfa_remove_eps(NFA* nfa) {
+    NFA_Builder* builder = nfa_builder_init();
+    Sparse_Set*  closure = sparse_set_init(nfa->num_states);
+    uint32_t*    rename  = malloc(sizeof(uint32_t) * nfa->num_states);
+    uint32_t*    queue   = malloc(sizeof(uint32_t) * nfa->num_states);
+    uint32_t     count   = 1;
+    uint32_t     state;
+    uint32_t     idx;
+    uint32_t     pos;
+    Range*       range;
+    NFA*         eps_free;
+
+    memset(rename, 0xff, sizeof(uint32_t) * nfa->num_states);
+    rename[0] = 0;
+    queue[0]  = 0;
+    state_add(builder, 0);
+    for (state = 0; state < count; ++state) {
+        sparse_set_clear(closure);
+        sparse_set_add(closure, queue[state]);
+        builder->final_status[state] = NFA_eps_closure(nfa, closure);
+        for (idx = 0; idx < closure->count; ++idx)
+            for (pos = nfa->range_pos[closure->dense[idx]]; \
+                    pos < nfa->range_pos[closure->dense[idx] + 1]; ++pos) {
+                range = nfa->range + pos;
+                if (rename[range->des] == UINT32_MAX) {
+                    rename[range->des] = state_add(builder, 0);
+                    queue[count++]     = range->des;
+                }
+                edge_add(builder, state, range->lo, range->hi, rename[range->des]);
+            }
+    }
+    eps_free = nfa_compile(builder);
+
+    nfa_builder_destroy(builder);
+    sparse_set_destroy(closure);
+    free(rename);
+    free(queue);
+    return eps_free;
+}
+
+void NFA_run(NFA* nfa, char* str) {
+    uint16_t    str_pt;
+    uint16_t    final_status;
+    uint32_t    idx;
+    Sparse_Set* now  = sparse_set_init(nfa->num_states);
+    Sparse_Set* next = sparse_set_init(nfa->num_states);
+    Sparse_Set* swap;
+    final_status = NFA_init(nfa, now);
     printf("================================\n\t");
-    for (state = NFA; state; state = state->next)
-        if (state->select_now)
-            printf("%p ", state);
+    for (idx = 0; idx < now->count; ++idx)
+        printf("%d ", now->dense[idx]);
     printf("\n");
     for (str_pt = 0; str_pt < strlen(str); ++str_pt) {
-        NFA_move(NFA, &select_count, &final_status, str[str_pt]);  
-        printf("%c, #s = %3d, f = %3d\n\t", str[str_pt], select_count, final_status);
-        for (state = NFA; state; state = state->next)
-            if (state->select_now)
-                printf("%p ", state);
+        final_status = NFA_move(nfa, now, next, (uint8_t)str[str_pt]);
+        swap = now;
+        now  = next;
+        next = swap;
+        printf("%c, #s = %3d, f = %3d\n\t", str[str_pt], now->count, final_status);
+        for (idx = 0; idx < now->count; ++idx)
+            printf("%d ", now->dense[idx]);
         printf("\n");
     }
     if (final_status)
         printf("ACCEPT by status %d\n", final_status);
     else
         printf("REJECT\n");
+    sparse_set_destroy(now);
+    sparse_set_destroy(next);
 }
 // =============================================================================
 
 // =============================================================================
-// Symbol Table
-#define SYMBOL_NUM 1009
+// Lazy DFA
+#define DFA_NUM_BUCKET   1024
+#define DFA_CACHE_BUDGET (1 << 22)
+#define DFA_MAX_FLUSH    8
 
-typedef struct {
-    uint16_t class;
-    char*    content;
-} Symbol;
+typedef struct dstate {
+    struct dstate* trans[NUM_SYMBOLS];
+    uint16_t       final_status;
+    uint16_t       id;
+    uint32_t       num_states;
+    uint32_t*      states;
+    uint64_t       hash;
+    struct dstate* next;
+} Dstate;
 
 typedef struct {
-    Symbol symbol[SYMBOL_NUM];
-    uint16_t count;
-} Symbol_Table;
+    NFA*        nfa;
+    Dstate*     bucket[DFA_NUM_BUCKET];
+    Dstate*     start;
+    Dstate      dead;
+    Dstate      spare[2];
+    uint16_t    spare_idx;
+    Sparse_Set* set;
+    uint64_t    mem_used;
+    uint64_t    mem_budget;
+    uint16_t    num_flush;
+    bool        fallback;
+} DFA;
 
-Symbol_Table* symbol_table_init() {
-    Symbol_Table* table = malloc(sizeof(Symbol_Table));
-    memset(table->symbol, 0, SYMBOL_NUM * sizeof(Symbol));
-    return table;
+DFA* dfa_init(NFA* nfa, uint64_t mem_budget) {
+    DFA* dfa = calloc(1, sizeof(DFA));
+    dfa->nfa             = nfa;
+    dfa->mem_budget      = mem_budget;
+    dfa->set             = sparse_set_init(nfa->num_states);
+    dfa->spare[0].states = malloc(sizeof(uint32_t) * nfa->num_states);
+    dfa->spare[1].states = malloc(sizeof(uint32_t) * nfa->num_states);
+    return dfa;
+}
+
+void dfa_flush(DFA* dfa) {
+    Dstate*  dstate;
+    uint16_t idx;
+    for (idx = 0; idx < DFA_NUM_BUCKET; ++idx)
+        while ((dstate = dfa->bucket[idx])) {
+            dfa->bucket[idx] = dstate->next;
+            free(dstate->states);
+            free(dstate);
+        }
+    dfa->start    = NULL;
+    dfa->mem_used = 0;
+    if (++(dfa->num_flush) > DFA_MAX_FLUSH)
+        dfa->fallback = true;
+}
+
+void dfa_destroy(DFA* dfa) {
+    dfa_flush(dfa);
+    sparse_set_destroy(dfa->set);
+    free(dfa->spare[0].states);
+    free(dfa->spare[1].states);
+    free(dfa);
 }
 
-uint16_t BKDR_hash(char* str) {
-    uint16_t seed = 131;
-    uint16_t hash = 0;
-    for (; *str; ++str)
-        hash = (hash * seed + *str) % SYMBOL_NUM;
+uint64_t dfa_hash(uint32_t* states, uint32_t num_states) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t idx;
+    for (idx = 0; idx < num_states; ++idx)
+        hash = (hash ^ states[idx]) * 1099511628211ULL;
     return hash;
 }
 
-Symbol* push_symbol(Symbol_Table* table, uint16_t class, char* content) {
-    uint16_t hash = BKDR_hash(content);
+int dfa_state_cmp(const void* a, const void* b) {
+    uint32_t sa = *(uint32_t*)a;
+    uint32_t sb = *(uint32_t*)b;
+    return (sa > sb) - (sa < sb);
+}
 
-    if (table->count >= SYMBOL_NUM) {
-        printf("TOO MANY SYMBOL\n");
-        exit(-1);
-    }
-    for (;; hash = (hash + 1) % SYMBOL_NUM)
-        if (!table->symbol[hash].content) {
-            table->symbol[hash].content = malloc(sizeof(char) * (strlen(content) + 1));
-            table->symbol[hash].class   = class;
-            strcpy(table->symbol[hash].content, content);
-            return table->symbol + hash;
-        }
-        else if (table->symbol[hash].class == class && \
-                !strcmp(table->symbol[hash].content, content))
-            return table->symbol + hash;
+// Close the set and sort it in place so equal sets are equal arrays. The
+// set is not used as a set again until the next clear.
+uint32_t dfa_close(DFA* dfa, uint16_t* final_status) {
+    *final_status = NFA_eps_closure(dfa->nfa, dfa->set);
+    qsort(dfa->set->dense, dfa->set->count, sizeof(uint32_t), dfa_state_cmp);
+    return dfa->set->count;
 }
 
-// =============================================================================
-// Lexical
-#define MAX_KEYWORD_LEN 10
+Dstate* dfa_add(DFA* dfa, uint32_t num_states, uint16_t final_status) {
+    uint64_t hash = dfa_hash(dfa->set->dense, num_states);
+    uint64_t size = sizeof(Dstate) + sizeof(uint32_t) * num_states;
+    Dstate*  dstate;
 
-#define CLASS_WHITE      1
-#define CLASS_IDENTIFIER 2
-#define CLASS_NUMBER     3
-#define CLASS_KEYWORD    4
-#define CLASS_OPERATOR   5
-#define CLASS_PUNCTUATOR 6
+    if (!num_states)
+        return &dfa->dead;
 
-union Token_content {
-    char     c[MAX_KEYWORD_LEN];
-    int64_t  d;
-    Symbol*  s; 
-};
+    if (!dfa->fallback) {
+        for (dstate = dfa->bucket[hash % DFA_NUM_BUCKET]; dstate; dstate = dstate->next)
+            if (dstate->hash == hash && dstate->num_states == num_states && \
+                    !memcmp(dstate->states, dfa->set->dense, sizeof(uint32_t) * num_states))
+                return dstate;
+        if (dfa->mem_used + size > dfa->mem_budget) {
+            STAT_ADD(dfa_flush, 1);
+            dfa_flush(dfa);
+        }
+    }
 
-typedef struct {
-    uint16_t            class;
-    union Token_content content;
-} Token;
+    // Out of budget too often, keep only the state in use and run as an NFA
+    if (dfa->fallback) {
+        dstate = dfa->spare + dfa->spare_idx;
+        dfa->spare_idx ^= 1;
+    }
+    else {
+        dstate         = calloc(1, sizeof(Dstate));
+        dstate->states = malloc(sizeof(uint32_t) * num_states);
+        dstate->next   = dfa->bucket[hash % DFA_NUM_BUCKET];
+        dfa->bucket[hash % DFA_NUM_BUCKET] = dstate;
+        dfa->mem_used += size;
+    }
+    memcpy(dstate->states, dfa->set->dense, sizeof(uint32_t) * num_states);
+    dstate->num_states   = num_states;
+    dstate->final_status = final_status;
+    dstate->hash         = hash;
+    return dstate;
+}
 
-typedef struct {
-    State*   nfa; 
-    FILE*    stream;
+Dstate* dfa_start(DFA* dfa) {
+    uint32_t num_states;
     uint16_t final_status;
-    Token*   (*post_process)(uint16_t, char*, Symbol_Table*);
+    if (dfa->start && !dfa->fallback)
+        return dfa->start;
+    sparse_set_clear(dfa->set);
+    sparse_set_add(dfa->set, 0);
+    num_states = dfa_close(dfa, &final_status);
+    dfa->start = dfa_add(dfa, num_states, final_status);
+    return dfa->start;
+}
+
+Dstate* dfa_step(DFA* dfa, Dstate* dstate, uint8_t symbol) {
+    Dstate*  next;
+    uint16_t num_flush = dfa->num_flush;
+    uint32_t num_states;
+    uint16_t final_status;
+    uint32_t idx;
+
+    if (dstate->trans[symbol] && !dfa->fallback) {
+        STAT_ADD(dfa_hit, 1);
+        return dstate->trans[symbol];
+    }
+    if (!dstate->num_states)
+        return &dfa->dead;
+
+    STAT_ADD(dfa_miss, 1);
+    sparse_set_clear(dfa->set);
+    for (idx = 0; idx < dstate->num_states; ++idx)
+        NFA_successor(dfa->nfa, dstate->states[idx], symbol, dfa->set);
+    num_states = dfa_close(dfa, &final_status);
+    STAT_ADD(nfa_move, 1);
+    STAT_ADD(nfa_active, num_states);
+    STAT_MAX(nfa_active_max, num_states);
+    next       = dfa_add(dfa, num_states, final_status);
+
+    // A flush frees dstate along with the rest of the cache
+    if (num_flush == dfa->num_flush && !dfa->fallback)
+        dstate->trans[symbol] = next;
+    return next;
+}
+// =============================================================================
+
+// =============================================================================
+// Compiled DFA
+// State 0 is dead and state 1 is the start state, rows are indexed by class
+#define SKIP_MAX_RANGE 8
+#define SKIP_PREFIX    8
+
+// Bytes on which a state steps to itself, as ranges [lo, hi]. States looping
+// on more than SKIP_MAX_RANGE ranges have none and are stepped bytewise.
+typedef struct {
+    uint8_t num_range;
+    uint8_t lo[SKIP_MAX_RANGE];
+    uint8_t hi[SKIP_MAX_RANGE];
+} Skip_Set;
+
+typedef struct dfa_table {
+    uint16_t  num_states;
+    uint16_t  num_classes;
+    uint8_t   byte_class[NUM_SYMBOLS];
+    uint16_t* table;
+    uint16_t* accept;
+    Skip_Set* skip;
+    uint64_t  (*skip_run)(struct dfa_table*, uint16_t, char*, uint64_t, uint64_t);
+} DFA_Table;
+
+// Explore every reachable DFA state, raw[s * NUM_SYMBOLS + symbol]
+uint16_t dfa_explore(NFA* nfa, uint16_t** raw, uint16_t** accept) {
+    DFA*     dfa       = dfa_init(nfa, UINT64_MAX);
+    Dstate** queue     = malloc(sizeof(Dstate*) * 2);
+    uint32_t queue_cap = 2;
+    uint16_t num_states;
+    uint16_t idx;
+    uint16_t symbol;
+    Dstate*  next;
+
+    queue[0]        = &dfa->dead;
+    queue[1]        = dfa_start(dfa);
+    queue[1]->id    = 1;
+    dfa->dead.id    = 0;
+    num_states      = 2;
+    for (idx = 1; idx < num_states; ++idx)
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol) {
+            next = dfa_step(dfa, queue[idx], symbol);
+            if (next == &dfa->dead || next->id)
+                continue;
+            if (num_states == UINT16_MAX) {
+                printf("TOO MANY DFA STATE\n");
+                exit(-1);
+            }
+            if (num_states == queue_cap) {
+                queue_cap *= 2;
+                queue      = realloc(queue, sizeof(Dstate*) * queue_cap);
+            }
+            next->id            = num_states;
+            queue[num_states++] = next;
+        }
+
+    *raw    = calloc(sizeof(uint16_t), (uint32_t)num_states * NUM_SYMBOLS);
+    *accept = calloc(sizeof(uint16_t), num_states);
+    for (idx = 1; idx < num_states; ++idx) {
+        (*accept)[idx] = queue[idx]->final_status;
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+            (*raw)[idx * NUM_SYMBOLS + symbol] = queue[idx]->trans[symbol]->id;
+    }
+    free(queue);
+    dfa_destroy(dfa);
+    return num_states;
+}
+
+// Hopcroft's partition refinement, returns the block of every state
+uint16_t dfa_minimize(uint16_t num_states, uint16_t* raw, uint16_t* accept, uint16_t* block_of) {
+    uint32_t* inv_pos   = calloc(sizeof(uint32_t), (uint32_t)num_states * NUM_SYMBOLS + 1);
+    uint16_t* inv       = malloc(sizeof(uint16_t) * num_states * NUM_SYMBOLS);
+    uint16_t* elem      = malloc(sizeof(uint16_t) * num_states);
+    uint16_t* loc       = malloc(sizeof(uint16_t) * num_states);
+    uint16_t* first     = malloc(sizeof(uint16_t) * (num_states + 1));
+    uint16_t* last      = malloc(sizeof(uint16_t) * (num_states + 1));
+    uint16_t* marked    = calloc(sizeof(uint16_t), num_states + 1);
+    uint16_t* touched   = malloc(sizeof(uint16_t) * num_states);
+    uint16_t* pred      = malloc(sizeof(uint16_t) * num_states);
+    bool*     is_marked = calloc(sizeof(bool), num_states);
+    bool*     in_work   = calloc(sizeof(bool), (uint32_t)(num_states + 1) * NUM_SYMBOLS);
+    uint32_t* work      = malloc(sizeof(uint32_t) * (num_states + 1) * NUM_SYMBOLS);
+    uint32_t  num_work  = 0;
+    uint16_t  num_block = 0;
+    uint16_t  num_touched;
+    uint16_t  num_pred;
+    uint16_t  state;
+    uint16_t  symbol;
+    uint16_t  block;
+    uint16_t  idx;
+    uint32_t  pos;
+
+    // Predecessor lists grouped by (destination, symbol)
+    for (state = 0; state < num_states; ++state)
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+            ++inv_pos[raw[state * NUM_SYMBOLS + symbol] * NUM_SYMBOLS + symbol + 1];
+    for (pos = 0; pos < (uint32_t)num_states * NUM_SYMBOLS; ++pos)
+        inv_pos[pos + 1] += inv_pos[pos];
+    for (state = 0; state < num_states; ++state)
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol) {
+            pos = raw[state * NUM_SYMBOLS + symbol] * NUM_SYMBOLS + symbol;
+            inv[inv_pos[pos]++] = state;
+        }
+    for (pos = (uint32_t)num_states * NUM_SYMBOLS; pos > 0; --pos)
+        inv_pos[pos] = inv_pos[pos - 1];
+    inv_pos[0] = 0;
+
+    // Initial partition by accepted rule, first[] holds a representative
+    for (state = 0; state < num_states; ++state) {
+        for (block = 0; block < num_block; ++block)
+            if (accept[first[block]] == accept[state])
+                break;
+        if (block == num_block) {
+            first[num_block] = state;
+            last[num_block]  = 0;
+            ++num_block;
+        }
+        block_of[state] = block;
+        ++last[block];
+    }
+    for (block = 0, pos = 0; block < num_block; ++block) {
+        first[block] = pos;
+        pos         += last[block];
+        last[block]  = first[block];
+    }
+    for (state = 0; state < num_states; ++state) {
+        block             = block_of[state];
+        elem[last[block]] = state;
+        loc[state]        = last[block]++;
+    }
+    for (block = 0; block < num_block; ++block)
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol) {
+            in_work[block * NUM_SYMBOLS + symbol] = true;
+            work[num_work++] = block * NUM_SYMBOLS + symbol;
+        }
+
+    while (num_work) {
+        pos    = work[--num_work];
+        in_work[pos] = false;
+        block  = pos / NUM_SYMBOLS;
+        symbol = pos % NUM_SYMBOLS;
+
+        num_pred = 0;
+        for (idx = first[block]; idx < last[block]; ++idx) {
+            state = elem[idx];
+            for (pos = inv_pos[state * NUM_SYMBOLS + symbol]; \
+                    pos < inv_pos[state * NUM_SYMBOLS + symbol + 1]; ++pos)
+                if (!is_marked[inv[pos]]) {
+                    is_marked[inv[pos]] = true;
+                    pred[num_pred++]    = inv[pos];
+                }
+        }
+
+        // Move marked states to the front of their blocks
+        num_touched = 0;
+        for (idx = 0; idx < num_pred; ++idx) {
+            uint16_t b    = block_of[pred[idx]];
+            uint16_t to   = first[b] + marked[b];
+            uint16_t from = loc[pred[idx]];
+            if (!marked[b])
+                touched[num_touched++] = b;
+            elem[from]      = elem[to];
+            loc[elem[from]] = from;
+            elem[to]        = pred[idx];
+            loc[pred[idx]]  = to;
+            ++marked[b];
+            is_marked[pred[idx]] = false;
+        }
+
+        for (idx = 0; idx < num_touched; ++idx) {
+            uint16_t b = touched[idx];
+            uint16_t n = num_block;
+            if (marked[b] == last[b] - first[b]) {
+                marked[b] = 0;
+                continue;
+            }
+            first[n]  = first[b];
+            last[n]   = first[b] + marked[b];
+            first[b]  = last[n];
+            marked[b] = 0;
+            ++num_block;
+            for (pos = first[n]; pos < last[n]; ++pos)
+                block_of[elem[pos]] = n;
+            for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol) {
+                uint16_t add = n;
+                if (!in_work[b * NUM_SYMBOLS + symbol] && \
+                        last[b] - first[b] < last[n] - first[n])
+                    add = b;
+                in_work[add * NUM_SYMBOLS + symbol] = true;
+                work[num_work++] = add * NUM_SYMBOLS + symbol;
+            }
+        }
+    }
+
+    free(inv_pos);
+    free(inv);
+    free(elem);
+    free(loc);
+    free(first);
+    free(last);
+    free(marked);
+    free(touched);
+    free(pred);
+    free(is_marked);
+    free(in_work);
+    free(work);
+    return num_block;
+}
+
+uint16_t dfa_table_step(DFA_Table* dfa_table, uint16_t state, uint8_t symbol) {
+    return dfa_table->table[state * dfa_table->num_classes + dfa_table->byte_class[symbol]];
+}
+
+// Skip runners return the first position in [pos, len) whose byte leaves
+// state, only called for states with a non-empty skip set
+uint64_t skip_run_scalar(DFA_Table* dfa_table, uint16_t state, char* buf, uint64_t pos, uint64_t len) {
+    uint16_t* row = dfa_table->table + state * dfa_table->num_classes;
+    while (pos < len && row[dfa_table->byte_class[(uint8_t)buf[pos]]] == state)
+        ++pos;
+    return pos;
+}
+
+// Most runs are short, so look at a few bytes before setting up vectors
+bool skip_run_prefix(DFA_Table* dfa_table, uint16_t state, char* buf, uint64_t* pos, uint64_t len) {
+    uint64_t stop = *pos + SKIP_PREFIX < len? *pos + SKIP_PREFIX: len;
+    *pos = skip_run_scalar(dfa_table, state, buf, *pos, stop);
+    return *pos < stop;
+}
+
+#ifdef HAVE_X86_SIMD
+// 16 bytes a step, one range compare of pcmpestri covers the whole skip set
+__attribute__((target("sse4.2")))
+uint64_t skip_run_sse42(DFA_Table* dfa_table, uint16_t state, char* buf, uint64_t pos, uint64_t len) {
+    Skip_Set* skip = dfa_table->skip + state;
+    uint8_t   range[16];
+    __m128i   ranges;
+    int       idx;
+
+    for (idx = 0; idx < skip->num_range; ++idx) {
+        range[idx * 2]     = skip->lo[idx];
+        range[idx * 2 + 1] = skip->hi[idx];
+    }
+    memset(range + skip->num_range * 2, 0, 16 - skip->num_range * 2);
+    ranges = _mm_loadu_si128((__m128i*)range);
+    if (skip_run_prefix(dfa_table, state, buf, &pos, len))
+        return pos;
+    while (pos + 16 <= len) {
+        idx = _mm_cmpestri(ranges, skip->num_range * 2, _mm_loadu_si128((__m128i*)(buf + pos)), 16, \
+                _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+        pos += idx;
+        if (idx < 16)
+            return pos;
+    }
+    return skip_run_scalar(dfa_table, state, buf, pos, len);
+}
+
+// 32 bytes a step, byte b is in [lo, hi] iff min(b - lo, hi - lo) == b - lo
+__attribute__((target("avx2,bmi")))
+uint64_t skip_run_avx2(DFA_Table* dfa_table, uint16_t state, char* buf, uint64_t pos, uint64_t len) {
+    Skip_Set* skip = dfa_table->skip + state;
+    __m256i   lo[SKIP_MAX_RANGE];
+    __m256i   width[SKIP_MAX_RANGE];
+    __m256i   data;
+    __m256i   shift;
+    __m256i   in;
+    uint32_t  mask;
+    int       idx;
+
+    if (skip_run_prefix(dfa_table, state, buf, &pos, len))
+        return pos;
+    for (idx = 0; idx < skip->num_range; ++idx) {
+        lo[idx]    = _mm256_set1_epi8(skip->lo[idx]);
+        width[idx] = _mm256_set1_epi8(skip->hi[idx] - skip->lo[idx]);
+    }
+    while (pos + 32 <= len) {
+        data = _mm256_loadu_si256((__m256i*)(buf + pos));
+        in   = _mm256_setzero_si256();
+        for (idx = 0; idx < skip->num_range; ++idx) {
+            shift = _mm256_sub_epi8(data, lo[idx]);
+            in    = _mm256_or_si256(in, _mm256_cmpeq_epi8(shift, _mm256_min_epu8(shift, width[idx])));
+        }
+        mask = ~(uint32_t)_mm256_movemask_epi8(in);
+        if (mask)
+            return pos + _tzcnt_u32(mask);
+        pos += 32;
+    }
+    return skip_run_scalar(dfa_table, state, buf, pos, len);
+}
+#endif
+
+// Pick the widest runner the CPU has
+void dfa_table_skip_select(DFA_Table* dfa_table) {
+    dfa_table->skip_run = skip_run_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi"))
+        dfa_table->skip_run = skip_run_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        dfa_table->skip_run = skip_run_sse42;
+#endif
+}
+
+// Collect the self loops of every state
+void dfa_table_skip_init(DFA_Table* dfa_table) {
+    Skip_Set* skip;
+    uint16_t  state;
+    uint16_t  symbol;
+    bool      loop;
+    bool      prev;
+
+    dfa_table->skip = calloc(sizeof(Skip_Set), dfa_table->num_states);
+    for (state = 1; state < dfa_table->num_states; ++state) {
+        skip = dfa_table->skip + state;
+        prev = false;
+        for (symbol = 0; symbol <= NUM_SYMBOLS; ++symbol) {
+            loop = symbol < NUM_SYMBOLS && symbol && dfa_table_step(dfa_table, state, symbol) == state;
+            if (loop && !prev) {
+                if (skip->num_range == SKIP_MAX_RANGE)
+                    break;
+                skip->lo[skip->num_range] = symbol;
+            }
+            if (!loop && prev)
+                skip->hi[skip->num_range++] = symbol - 1;
+            prev = loop;
+        }
+        if (symbol <= NUM_SYMBOLS)
+            skip->num_range = 0;
+    }
+    dfa_table_skip_select(dfa_table);
+}
+
+DFA_Table* dfa_table_init(NFA* nfa) {
+    DFA_Table* dfa_table = malloc(sizeof(DFA_Table));
+    uint16_t*  raw;
+    uint16_t*  accept;
+    uint16_t*  block_of;
+    uint16_t*  rename;
+    uint16_t*  column;
+    uint16_t   num_states = dfa_explore(nfa, &raw, &accept);
+    uint16_t   num_block;
+    uint16_t   state;
+    uint16_t   symbol;
+    uint16_t   other;
+    uint16_t   block;
+
+    block_of  = malloc(sizeof(uint16_t) * num_states);
+    num_block = dfa_minimize(num_states, raw, accept, block_of);
+
+    // Dead block first, start block second, the rest in discovery order
+    rename = malloc(sizeof(uint16_t) * num_block);
+    memset(rename, 0xff, sizeof(uint16_t) * num_block);
+    dfa_table->num_states = 0;
+    rename[block_of[0]]   = dfa_table->num_states++;
+    if (rename[block_of[1]] == UINT16_MAX)
+        rename[block_of[1]] = dfa_table->num_states++;
+    for (state = 2; state < num_states; ++state)
+        if (rename[block_of[state]] == UINT16_MAX)
+            rename[block_of[state]] = dfa_table->num_states++;
+
+    // Minimized columns, bytes with equal columns share a class
+    column = malloc(sizeof(uint16_t) * num_block * NUM_SYMBOLS);
+    for (state = 0; state < num_states; ++state)
+        for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol)
+            column[symbol * num_block + rename[block_of[state]]] = \
+                rename[block_of[raw[state * NUM_SYMBOLS + symbol]]];
+    dfa_table->num_classes = 0;
+    for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol) {
+        for (other = 0; other < symbol; ++other)
+            if (!memcmp(column + symbol * num_block, column + other * num_block, \
+                        sizeof(uint16_t) * num_block))
+                break;
+        if (other < symbol)
+            dfa_table->byte_class[symbol] = dfa_table->byte_class[other];
+        else
+            dfa_table->byte_class[symbol] = dfa_table->num_classes++;
+    }
+
+    dfa_table->table  = malloc(sizeof(uint16_t) * num_block * dfa_table->num_classes);
+    dfa_table->accept = malloc(sizeof(uint16_t) * num_block);
+    for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol)
+        for (block = 0; block < num_block; ++block)
+            dfa_table->table[block * dfa_table->num_classes + dfa_table->byte_class[symbol]] = \
+                column[symbol * num_block + block];
+    for (state = 0; state < num_states; ++state)
+        dfa_table->accept[rename[block_of[state]]] = accept[state];
+
+    dfa_table_skip_init(dfa_table);
+
+#ifdef LEX_STATS
+    fprintf(stderr, "Compile DFA done, states = %d -> %d, classes = %d\n", \
+            num_states, dfa_table->num_states, dfa_table->num_classes);
+#endif
+    free(raw);
+    free(accept);
+    free(block_of);
+    free(rename);
+    free(column);
+    return dfa_table;
+}
+
+void dfa_table_destroy(DFA_Table* dfa_table) {
+    free(dfa_table->table);
+    free(dfa_table->accept);
+    free(dfa_table->skip);
+    free(dfa_table);
+}
+
+// =============================================================================
+
+// =============================================================================
+// Keyword
+// Perfect hash in the style of gperf. A word is keyed by its length and a few
+// byte positions, and seeds are tried until no two keywords share a slot.
+#define KEYWORD_MAX_SEED  4096
+#define KEYWORD_MIN_SHIFT 12
+
+// Slot words are offsets into text, a slot of length 0 is empty
+typedef struct {
+    uint32_t* word;
+    uint32_t* len;
+    char*     text;
+    uint32_t  text_len;
+    uint32_t  seed;
+    uint16_t  shift;
+    uint32_t  min_len;
+    uint32_t  max_len;
+    bool      full;
+    uint16_t  class;
+    uint16_t  from_class;
+} Keyword_Set;
+
+uint32_t keyword_key(Keyword_Set* set, char* word, uint32_t len) {
+    uint32_t key = 2166136261u;
+    uint32_t idx;
+    if (!set->full)
+        return len | (uint8_t)word[0] << 8 | (uint8_t)word[len - 1] << 16 | \
+               (uint32_t)(uint8_t)word[len > 1] << 24;
+    for (idx = 0; idx < len; ++idx)
+        key = (key ^ (uint8_t)word[idx]) * 16777619u;
+    return key;
+}
+
+uint32_t keyword_slot(Keyword_Set* set, uint32_t key) {
+    return (key * set->seed) >> set->shift;
+}
+
+// Try seeds over a table of 2^(32 - shift) slots, the slots are filled on success
+bool keyword_place(Keyword_Set* set, char** words, uint16_t num_words) {
+    uint32_t size = 1u << (32 - set->shift);
+    uint32_t rand = 0x9e3779b9u;
+    uint32_t slot;
+    uint16_t count;
+    uint16_t idx;
+
+    for (count = 0; count < KEYWORD_MAX_SEED; ++count) {
+        rand      = rand * 1664525u + 1013904223u;
+        set->seed = rand | 1;
+        memset(set->word, 0, sizeof(uint32_t) * size);
+        memset(set->len, 0, sizeof(uint32_t) * size);
+        for (idx = 0; idx < num_words; ++idx) {
+            slot = keyword_slot(set, keyword_key(set, words[idx], strlen(words[idx])));
+            if (set->len[slot])
+                break;
+            set->word[slot] = words[idx] - set->text;
+            set->len[slot]  = strlen(words[idx]);
+        }
+        if (idx == num_words)
+            return true;
+    }
+    return false;
+}
+
+Keyword_Set* keyword_set_init(char** words, uint16_t num_words, uint16_t class, uint16_t from_class) {
+    Keyword_Set* set      = calloc(1, sizeof(Keyword_Set));
+    char**       copy     = malloc(sizeof(char*) * num_words);
+    uint32_t     text_len = 0;
+    uint32_t     size;
+    uint32_t     len;
+    uint16_t     num_copy = 0;
+    uint16_t     idx;
+    uint16_t     other;
+
+    set->class      = class;
+    set->from_class = from_class;
+    set->min_len    = UINT32_MAX;
+    for (idx = 0; idx < num_words; ++idx) {
+        len       = strlen(words[idx]);
+        text_len += len + 1;
+        if (!len) {
+            printf("Empty keyword\n");
+            exit(-1);
+        }
+        if (len < set->min_len)
+            set->min_len = len;
+        if (len > set->max_len)
+            set->max_len = len;
+    }
+
+    // Keep one copy of every word, a repeated word would never get a slot
+    set->text = malloc(text_len);
+    for (idx = 0, text_len = 0; idx < num_words; ++idx) {
+        for (other = 0; other < num_copy && strcmp(copy[other], words[idx]); ++other);
+        if (other < num_copy)
+            continue;
+        copy[num_copy++] = strcpy(set->text + text_len, words[idx]);
+        text_len        += strlen(words[idx]) + 1;
+    }
+    set->text_len = text_len;
+
+    // Positions only work when no two words agree on all of them
+    for (idx = 0; idx < num_copy && !set->full; ++idx)
+        for (other = 0; other < idx; ++other)
+            if (keyword_key(set, copy[idx], strlen(copy[idx])) == \
+                    keyword_key(set, copy[other], strlen(copy[other]))) {
+                set->full = true;
+                break;
+            }
+
+    for (set->shift = 31, size = 2; size < 2u * num_copy; size *= 2)
+        --(set->shift);
+    set->word = malloc(sizeof(uint32_t) * size);
+    set->len  = malloc(sizeof(uint32_t) * size);
+    while (!keyword_place(set, copy, num_copy)) {
+        if (set->shift <= KEYWORD_MIN_SHIFT) {
+            printf("Keywords do not fit a table of %u slots\n", size);
+            exit(-1);
+        }
+        --(set->shift);
+        size     *= 2;
+        set->word = realloc(set->word, sizeof(uint32_t) * size);
+        set->len  = realloc(set->len, sizeof(uint32_t) * size);
+    }
+    free(copy);
+    return set;
+}
+
+void keyword_set_destroy(Keyword_Set* set) {
+    free(set->word);
+    free(set->len);
+    free(set->text);
+    free(set);
+}
+
+bool keyword_lookup(Keyword_Set* set, char* word, uint32_t len) {
+    uint32_t slot;
+    if (len < set->min_len || len > set->max_len)
+        return false;
+    slot = keyword_slot(set, keyword_key(set, word, len));
+    return set->len[slot] == len && !memcmp(set->text + set->word[slot], word, len);
+}
+// =============================================================================
+
+// =============================================================================
+// Symbol Table
+// Open addressing over a power of two, grown at half load. Slots keep the
+// full hash so probes and rehashing rarely touch the strings, which are
+// interned together with their Symbol in large text blocks. A concurrent
+// table is a set of such tables picked by the top hash bits, each behind
+// its own lock.
+#define SYMBOL_INIT_SIZE 1024
+#define TEXT_BLOCK_SIZE  (1 << 16)
+#define SYMBOL_SHARD_BIT 6
+
+typedef struct {
+    uint16_t class;
+    uint32_t len;
+    uint64_t hash;
+    char*    content;
+} Symbol;
+
+typedef struct {
+    uint64_t hash;
+    Symbol*  symbol;
+} Symbol_Slot;
+
+typedef struct text_block {
+    struct text_block* next;
+    uint64_t           used;
+    uint64_t           cap;
+    char               text[];
+} Text_Block;
+
+typedef struct symbol_table {
+    Symbol_Slot*         slot;
+    uint64_t             mask;
+    uint64_t             count;
+    Text_Block*          block;
+    struct symbol_table* shard;
+    pthread_mutex_t*     lock;
+} Symbol_Table;
+
+void symbol_table_setup(Symbol_Table* table) {
+    table->slot  = calloc(sizeof(Symbol_Slot), SYMBOL_INIT_SIZE);
+    table->mask  = SYMBOL_INIT_SIZE - 1;
+    table->count = 0;
+    table->block = NULL;
+    table->shard = NULL;
+    table->lock  = NULL;
+}
+
+Symbol_Table* symbol_table_init() {
+    Symbol_Table* table = malloc(sizeof(Symbol_Table));
+    symbol_table_setup(table);
+    return table;
+}
+
+// Safe for push_symbol from many threads at once
+Symbol_Table* symbol_table_init_concurrent() {
+    Symbol_Table* table = symbol_table_init();
+    uint16_t      idx;
+    table->shard = malloc(sizeof(Symbol_Table) << SYMBOL_SHARD_BIT);
+    table->lock  = malloc(sizeof(pthread_mutex_t) << SYMBOL_SHARD_BIT);
+    for (idx = 0; idx < 1 << SYMBOL_SHARD_BIT; ++idx) {
+        symbol_table_setup(table->shard + idx);
+        pthread_mutex_init(table->lock + idx, NULL);
+    }
+    return table;
+}
+
+void symbol_table_clear(Symbol_Table* table) {
+    Text_Block* block;
+    while ((block = table->block)) {
+        table->block = block->next;
+        free(block);
+    }
+    free(table->slot);
+}
+
+void symbol_table_destroy(Symbol_Table* table) {
+    uint16_t idx;
+    if (table->shard) {
+        for (idx = 0; idx < 1 << SYMBOL_SHARD_BIT; ++idx) {
+            symbol_table_clear(table->shard + idx);
+            pthread_mutex_destroy(table->lock + idx);
+        }
+        free(table->shard);
+        free(table->lock);
+    }
+    symbol_table_clear(table);
+    free(table);
+}
+
+uint64_t symbol_table_count(Symbol_Table* table) {
+    uint64_t count = table->count;
+    uint16_t idx;
+    for (idx = 0; table->shard && idx < 1 << SYMBOL_SHARD_BIT; ++idx)
+        count += table->shard[idx].count;
+    return count;
+}
+
+// 64-bit multiply-xorshift over 8 bytes at a time
+uint64_t symbol_hash(char* str, uint32_t len) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t word;
+    for (; len >= 8; str += 8, len -= 8) {
+        memcpy(&word, str, 8);
+        hash  = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+    }
+    if (len) {
+        word = 0;
+        memcpy(&word, str, len);
+        hash  = (hash ^ word) * 0x94d049bb133111ebULL;
+        hash ^= hash >> 29;
+    }
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Bump allocation from the newest text block, 8-byte aligned
+void* symbol_table_alloc(Symbol_Table* table, uint64_t size) {
+    Text_Block* block = table->block;
+    void*       ptr;
+    size = (size + 7) & ~7ULL;
+    if (!block || block->used + size > block->cap) {
+        uint64_t cap = size > TEXT_BLOCK_SIZE? size: TEXT_BLOCK_SIZE;
+        block        = malloc(sizeof(Text_Block) + cap);
+        block->next  = table->block;
+        block->used  = 0;
+        block->cap   = cap;
+        table->block = block;
+    }
+    ptr          = block->text + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void symbol_table_grow(Symbol_Table* table) {
+    Symbol_Slot* slot = table->slot;
+    uint64_t     size = table->mask + 1;
+    uint64_t     idx;
+    uint64_t     pos;
+
+    table->slot = calloc(sizeof(Symbol_Slot), size * 2);
+    table->mask = size * 2 - 1;
+    for (idx = 0; idx < size; ++idx)
+        if (slot[idx].symbol) {
+            for (pos = slot[idx].hash & table->mask; table->slot[pos].symbol; \
+                    pos = (pos + 1) & table->mask);
+            table->slot[pos] = slot[idx];
+        }
+    free(slot);
+}
+
+Symbol* push_symbol_hashed(Symbol_Table* table, uint16_t class, char* content, uint32_t len, uint64_t hash) {
+    uint64_t pos;
+    Symbol*  symbol;
+
+    STAT_ADD(symbol_lookup, 1);
+    for (pos = hash & table->mask; table->slot[pos].symbol; pos = (pos + 1) & table->mask) {
+        STAT_ADD(symbol_probe, 1);
+        symbol = table->slot[pos].symbol;
+        if (table->slot[pos].hash == hash && symbol->len == len && \
+                symbol->class == class && !memcmp(symbol->content, content, len)) {
+            STAT_MAX(symbol_probe_max, ((pos - hash) & table->mask) + 1);
+            return symbol;
+        }
+    }
+    STAT_MAX(symbol_probe_max, ((pos - hash) & table->mask) + 1);
+
+    symbol          = symbol_table_alloc(table, sizeof(Symbol) + len + 1);
+    symbol->class   = class;
+    symbol->len     = len;
+    symbol->hash    = hash;
+    symbol->content = (char*)(symbol + 1);
+    memcpy(symbol->content, content, len);
+    symbol->content[len]    = 0;
+    table->slot[pos].hash   = hash;
+    table->slot[pos].symbol = symbol;
+    if (++(table->count) * 2 > table->mask + 1)
+        symbol_table_grow(table);
+    return symbol;
+}
+
+// Intern the span [content, content + len), the span is copied only when new
+Symbol* push_symbol(Symbol_Table* table, uint16_t class, char* content, uint32_t len) {
+    uint64_t hash = symbol_hash(content, len) ^ ((uint64_t)class << 48);
+    uint64_t idx  = hash >> (64 - SYMBOL_SHARD_BIT);
+    Symbol*  symbol;
+    if (!table->shard)
+        return push_symbol_hashed(table, class, content, len, hash);
+    pthread_mutex_lock(table->lock + idx);
+    symbol = push_symbol_hashed(table->shard + idx, class, content, len, hash);
+    pthread_mutex_unlock(table->lock + idx);
+    return symbol;
+}
+// =============================================================================
+
+// =============================================================================
+// Automaton
+// A compiled rule set. Nothing in it is written while scanning, so one
+// automaton serves any number of match contexts, one per thread.
+#define KIND_KEEP   0
+#define KIND_SKIP   1
+#define KIND_SYMBOL 2
+#define KIND_NUMBER 3
+
+// A loaded automaton has its arrays in the mapping of its file
+typedef struct {
+    NFA*         nfa;
+    DFA_Table*   dfa_table;
+    Keyword_Set* keyword;
+    uint8_t      class_kind[MAX_CLASS];
+    void*        map;
+    uint64_t     map_len;
+} Automaton;
+
+// Everything a scan writes, the lazy DFA cache included
+typedef struct {
+    Automaton* automaton;
+    DFA*       dfa;
+    uint64_t   dfa_budget;
+    uint64_t   stop;            // where the last scan stopped reading
+} Match_Ctx;
+
+Automaton* automaton_init() {
+    Automaton* automaton = calloc(1, sizeof(Automaton));
+    memset(automaton->class_kind, KIND_KEEP, MAX_CLASS);
+    return automaton;
+}
+
+// Drop the compiled automata, the rule set changed
+void automaton_reset(Automaton* automaton) {
+    if (automaton->dfa_table) {
+        dfa_table_destroy(automaton->dfa_table);
+        automaton->dfa_table = NULL;
+    }
+    if (automaton->nfa) {
+        nfa_destroy(automaton->nfa);
+        automaton->nfa = NULL;
+    }
+}
+
+void automaton_destroy(Automaton* automaton) {
+    if (automaton->map) {
+        free(automaton->nfa);
+        free(automaton->dfa_table);
+        free(automaton->keyword);
+        munmap(automaton->map, automaton->map_len);
+        free(automaton);
+        return;
+    }
+    automaton_reset(automaton);
+    if (automaton->keyword)
+        keyword_set_destroy(automaton->keyword);
+    free(automaton);
+}
+
+Match_Ctx* match_ctx_init(Automaton* automaton, uint64_t dfa_budget) {
+    Match_Ctx* ctx  = malloc(sizeof(Match_Ctx));
+    ctx->automaton  = automaton;
+    ctx->dfa        = NULL;
+    ctx->dfa_budget = dfa_budget;
+    ctx->stop       = 0;
+    return ctx;
+}
+
+void match_ctx_reset(Match_Ctx* ctx) {
+    if (ctx->dfa) {
+        dfa_destroy(ctx->dfa);
+        ctx->dfa = NULL;
+    }
+}
+
+void match_ctx_destroy(Match_Ctx* ctx) {
+    match_ctx_reset(ctx);
+    free(ctx);
+}
+
+// Run the table from state over buf[*pos, len) until it dies, the last accept
+// seen is left in final_status and end. Returns the state, 0 when dead.
+uint16_t match_table_run(DFA_Table* dfa_table, uint16_t state, char* buf, uint64_t* pos, uint64_t len, \
+        uint16_t* final_status, uint64_t* end) {
+    uint64_t next = *pos;
+    while (next < len) {
+        state = dfa_table_step(dfa_table, state, (uint8_t)buf[next++]);
+        STAT_ADD(table_step, 1);
+        if (!state)
+            break;
+        // Runs that keep the state, e.g. whitespace or the rest of an identifier
+        if (dfa_table->skip[state].num_range) {
+            STAT_ADD(table_skip, -next);
+            next = dfa_table->skip_run(dfa_table, state, buf, next, len);
+            STAT_ADD(table_skip, next);
+        }
+        if (dfa_table->accept[state]) {
+            *final_status = dfa_table->accept[state];
+            *end          = next;
+        }
+    }
+    *pos = next;
+    return state;
+}
+
+// A match of class from_class spelled as a keyword is of the keyword class
+void match_keyword(Automaton* automaton, char* buf, uint64_t start, uint64_t end, uint16_t* final_status) {
+    if (automaton->keyword && *final_status == automaton->keyword->from_class && \
+            keyword_lookup(automaton->keyword, buf + start, end - start))
+        *final_status = automaton->keyword->class;
+}
+
+// Longest match of buf[pos, len), returns where it ends and sets final_status
+uint64_t match_scan(Match_Ctx* ctx, char* buf, uint64_t pos, uint64_t len, uint16_t* final_status) {
+    Automaton* automaton = ctx->automaton;
+    uint64_t   start     = pos;
+    uint64_t   end       = pos;
+
+    *final_status = 0;
+    if (automaton->dfa_table)
+        match_table_run(automaton->dfa_table, 1, buf, &pos, len, final_status, &end);
+    else {
+        Dstate* dstate;
+        if (!ctx->dfa)
+            ctx->dfa = dfa_init(automaton->nfa, ctx->dfa_budget);
+        dstate = dfa_start(ctx->dfa);
+        while (pos < len) {
+            dstate = dfa_step(ctx->dfa, dstate, (uint8_t)buf[pos++]);
+            if (!dstate->num_states)
+                break;
+            if (dstate->final_status) {
+                *final_status = dstate->final_status;
+                end           = pos;
+            }
+        }
+    }
+    match_keyword(automaton, buf, start, end, final_status);
+    STAT_ADD(scan, 1);
+    STAT_ADD(backtrack, pos - end);
+    STAT_MAX(backtrack_max, pos - end);
+    STAT_ADD(rule_tokens[*final_status], 1);
+    STAT_ADD(rule_bytes[*final_status], end - start);
+    ctx->stop = pos;
+    return end;
+}
+// =============================================================================
+
+// =============================================================================
+// Search
+// Unanchored search for one regexp. Candidate starts come from a prefilter
+// read off the tree: memmem for a literal prefix of two or more bytes,
+// memchr for a single leading byte, otherwise a byte table of the possible
+// first bytes. Only candidates are handed to match_scan, which gives the
+// longest match starting there, so the first candidate that matches is the
+// leftmost-longest match. Empty matches are not reported.
+typedef struct {
+    Automaton* automaton;
+    Match_Ctx* ctx;
+    uint8_t    prefix[MAX_REG_LEN];
+    uint16_t   prefix_len;
+    bool       first[NUM_SYMBOLS];
+    uint16_t   num_first;
+    bool       any;             // a match may start with any byte
+} Search;
+
+// Add the bytes a match of node can start with, true when it matches empty
+bool regnode_first(Regnode* node, bool* first) {
+    uint16_t symbol;
+    bool     left;
+    bool     right;
+    if (node->val == OP_SET) {
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+            first[symbol] |= set_has(node->set, symbol);
+        return false;
+    }
+    if (node->val == OP_STAR) {
+        regnode_first(node->left, first);
+        return true;
+    }
+    if (node->val == OP_UNI) {
+        left  = regnode_first(node->left, first);
+        right = regnode_first(node->right, first);
+        return left || right;
+    }
+    if (node->val == OP_CON)
+        return regnode_first(node->left, first) && regnode_first(node->right, first);
+    return true;
+}
+
+Search* search_init(char* regexp) {
+    Search*      search   = calloc(1, sizeof(Search));
+    NFA_Builder* builder  = nfa_builder_init();
+    Literal_Set* literals = calloc(1, sizeof(Literal_Set));
+    Regnode*     root     = regexp_to_regnode(regexp);
+    uint16_t     symbol;
+    Fragment     frag;
+    NFA*         nfa;
+
+    // A partial string still leaves its leading bytes in the set
+    regnode_literal(root, literals);
+    memcpy(search->prefix, literals->text, literals->num_bytes);
+    search->prefix_len = literals->num_bytes;
+    search->any        = regnode_first(root, search->first);
+    for (symbol = 0; symbol < NUM_SYMBOLS; ++symbol)
+        if (search->first[symbol]) {
+            ++search->num_first;
+            if (!search->prefix_len)
+                search->prefix[0] = symbol;
+        }
+    // A single first byte is a prefix too
+    if (!search->any && search->num_first == 1)
+        search->prefix_len = search->prefix_len? search->prefix_len: 1;
+
+    memset(literals, 0, sizeof(Literal_Set));
+    state_add(builder, 0);
+    if (regnode_literals(root, literals))
+        frag = literals_to_nfa(builder, literals, 1);
+    else
+        frag = regnode_to_nfa(builder, root, 1);
+    eps_add(builder, 0, frag.start);
+    nfa = nfa_compile(builder);
+
+    search->automaton            = automaton_init();
+    search->automaton->nfa       = nfa_remove_eps(nfa);
+    search->automaton->dfa_table = dfa_table_init(search->automaton->nfa);
+    search->ctx                  = match_ctx_init(search->automaton, DFA_CACHE_BUDGET);
+
+    nfa_destroy(nfa);
+    nfa_builder_destroy(builder);
+    regnode_destroy(root);
+    free(literals);
+    return search;
+}
+
+void search_destroy(Search* search) {
+    match_ctx_destroy(search->ctx);
+    automaton_destroy(search->automaton);
+    free(search);
+}
+
+// The first position in [pos, len) a match may start at, len if none
+uint64_t search_candidate(Search* search, char* buf, uint64_t pos, uint64_t len) {
+    char* found;
+    if (search->any || pos >= len)
+        return pos;
+    if (search->prefix_len > 1) {
+        found = memmem(buf + pos, len - pos, search->prefix, search->prefix_len);
+        return found? (uint64_t)(found - buf): len;
+    }
+    if (search->prefix_len) {
+        found = memchr(buf + pos, search->prefix[0], len - pos);
+        return found? (uint64_t)(found - buf): len;
+    }
+    while (pos < len && !search->first[(uint8_t)buf[pos]])
+        ++pos;
+    return pos;
+}
+
+// Leftmost-longest match in buf[pos, len), false when there is none
+bool search_find(Search* search, char* buf, uint64_t pos, uint64_t len, uint64_t* start, uint64_t* end) {
+    uint16_t final_status;
+    for (pos = search_candidate(search, buf, pos, len); pos < len; \
+            pos = search_candidate(search, buf, pos + 1, len)) {
+        *end = match_scan(search->ctx, buf, pos, len, &final_status);
+        if (final_status) {
+            *start = pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Report the non-overlapping matches of buf[0, len) in order, returns how
+// many there were
+uint64_t search_find_all(Search* search, char* buf, uint64_t len, \
+        void (*found)(void*, uint64_t, uint64_t), void* arg) {
+    uint64_t num_match = 0;
+    uint64_t start;
+    uint64_t end       = 0;
+    while (search_find(search, buf, end, len, &start, &end)) {
+        found(arg, start, end);
+        ++num_match;
+    }
+    return num_match;
+}
+// =============================================================================
+
+// =============================================================================
+// Automaton File
+// A compiled automaton saved as one block: a header, then every array at an
+// 8-byte aligned offset from the start of the file. Loading maps the file
+// and points the structures at those offsets, nothing is parsed or copied
+// beyond the headers. The layout follows the host byte order and struct
+// layout, files are rejected on a different version or NUM_SYMBOLS.
+#define AUTOMATON_MAGIC   0x4f5455414745521aULL
+#define AUTOMATON_VERSION 1
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_symbols;
+    uint64_t size;
+    uint8_t  class_kind[MAX_CLASS];
+
+    uint32_t nfa_states;
+    uint32_t nfa_ranges;
+    uint32_t nfa_eps;
+    uint64_t nfa_range_pos;
+    uint64_t nfa_range;
+    uint64_t nfa_eps_pos;
+    uint64_t nfa_eps_list;
+    uint64_t nfa_final_status;
+
+    uint16_t dfa_states;
+    uint16_t dfa_classes;
+    uint64_t dfa_byte_class;
+    uint64_t dfa_table;
+    uint64_t dfa_accept;
+    uint64_t dfa_skip;
+
+    uint32_t keyword_slots;     // 0 without keywords
+    uint32_t keyword_text_len;
+    uint32_t keyword_seed;
+    uint16_t keyword_shift;
+    uint32_t keyword_min_len;
+    uint32_t keyword_max_len;
+    uint8_t  keyword_full;
+    uint16_t keyword_class;
+    uint16_t keyword_from_class;
+    uint64_t keyword_word;
+    uint64_t keyword_len;
+    uint64_t keyword_text;
+} Automaton_File;
+
+// Reserve len bytes at the next aligned offset, returns the offset
+uint64_t automaton_file_place(uint64_t* size, uint64_t len) {
+    uint64_t offset = (*size + 7) & ~7ULL;
+    *size = offset + len;
+    return offset;
+}
+
+// The automaton must be compiled with lex_compile
+void automaton_save(Automaton* automaton, char* filename) {
+    Automaton_File head;
+    NFA*           nfa       = automaton->nfa;
+    DFA_Table*     dfa_table = automaton->dfa_table;
+    Keyword_Set*   keyword   = automaton->keyword;
+    char*          block;
+    FILE*          file;
+
+    if (!nfa || !dfa_table) {
+        printf("Save a compiled automaton\n");
+        exit(-1);
+    }
+    memset(&head, 0, sizeof(head));
+    head.magic       = AUTOMATON_MAGIC;
+    head.version     = AUTOMATON_VERSION;
+    head.num_symbols = NUM_SYMBOLS;
+    head.size        = sizeof(head);
+    memcpy(head.class_kind, automaton->class_kind, MAX_CLASS);
+
+    head.nfa_states       = nfa->num_states;
+    head.nfa_ranges       = nfa->range_pos[nfa->num_states];
+    head.nfa_eps          = nfa->eps_pos[nfa->num_states];
+    head.nfa_range_pos    = automaton_file_place(&head.size, sizeof(uint32_t) * (head.nfa_states + 1));
+    head.nfa_range        = automaton_file_place(&head.size, sizeof(Range) * head.nfa_ranges);
+    head.nfa_eps_pos      = automaton_file_place(&head.size, sizeof(uint32_t) * (head.nfa_states + 1));
+    head.nfa_eps_list     = automaton_file_place(&head.size, sizeof(uint32_t) * head.nfa_eps);
+    head.nfa_final_status = automaton_file_place(&head.size, sizeof(uint16_t) * head.nfa_states);
+
+    head.dfa_states     = dfa_table->num_states;
+    head.dfa_classes    = dfa_table->num_classes;
+    head.dfa_byte_class = automaton_file_place(&head.size, NUM_SYMBOLS);
+    head.dfa_table      = automaton_file_place(&head.size, \
+            sizeof(uint16_t) * head.dfa_states * head.dfa_classes);
+    head.dfa_accept     = automaton_file_place(&head.size, sizeof(uint16_t) * head.dfa_states);
+    head.dfa_skip       = automaton_file_place(&head.size, sizeof(Skip_Set) * head.dfa_states);
+
+    if (keyword) {
+        head.keyword_slots      = 1u << (32 - keyword->shift);
+        head.keyword_text_len   = keyword->text_len;
+        head.keyword_seed       = keyword->seed;
+        head.keyword_shift      = keyword->shift;
+        head.keyword_min_len    = keyword->min_len;
+        head.keyword_max_len    = keyword->max_len;
+        head.keyword_full       = keyword->full;
+        head.keyword_class      = keyword->class;
+        head.keyword_from_class = keyword->from_class;
+        head.keyword_word = automaton_file_place(&head.size, sizeof(uint32_t) * head.keyword_slots);
+        head.keyword_len  = automaton_file_place(&head.size, sizeof(uint32_t) * head.keyword_slots);
+        head.keyword_text = automaton_file_place(&head.size, head.keyword_text_len);
+    }
+
+    block = calloc(1, head.size);
+    memcpy(block, &head, sizeof(head));
+    memcpy(block + head.nfa_range_pos, nfa->range_pos, sizeof(uint32_t) * (head.nfa_states + 1));
+    memcpy(block + head.nfa_range, nfa->range, sizeof(Range) * head.nfa_ranges);
+    memcpy(block + head.nfa_eps_pos, nfa->eps_pos, sizeof(uint32_t) * (head.nfa_states + 1));
+    memcpy(block + head.nfa_eps_list, nfa->eps, sizeof(uint32_t) * head.nfa_eps);
+    memcpy(block + head.nfa_final_status, nfa->final_status, sizeof(uint16_t) * head.nfa_states);
+    memcpy(block + head.dfa_byte_class, dfa_table->byte_class, NUM_SYMBOLS);
+    memcpy(block + head.dfa_table, dfa_table->table, sizeof(uint16_t) * head.dfa_states * head.dfa_classes);
+    memcpy(block + head.dfa_accept, dfa_table->accept, sizeof(uint16_t) * head.dfa_states);
+    memcpy(block + head.dfa_skip, dfa_table->skip, sizeof(Skip_Set) * head.dfa_states);
+    if (keyword) {
+        memcpy(block + head.keyword_word, keyword->word, sizeof(uint32_t) * head.keyword_slots);
+        memcpy(block + head.keyword_len, keyword->len, sizeof(uint32_t) * head.keyword_slots);
+        memcpy(block + head.keyword_text, keyword->text, head.keyword_text_len);
+    }
+
+    file = fopen(filename, "wb");
+    if (!file || fwrite(block, 1, head.size, file) != head.size) {
+        printf("Cannot write %s\n", filename);
+        exit(-1);
+    }
+    fclose(file);
+    free(block);
+}
+
+// Whether count items of size bytes at an aligned offset lie within the file
+bool automaton_file_fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t file_size) {
+    return !(offset & 7) && offset >= sizeof(Automaton_File) && offset <= file_size && \
+           count * size <= file_size - offset;
+}
+
+Automaton* automaton_load(char* filename) {
+    Automaton*      automaton;
+    Automaton_File* head;
+    NFA*            nfa;
+    DFA_Table*      dfa_table;
+    Keyword_Set*    keyword;
+    struct stat     st;
+    char*           map;
+    int             fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(Automaton_File)) {
+        printf("Cannot load %s\n", filename);
+        exit(-1);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    head = (Automaton_File*)map;
+    if (map == MAP_FAILED || head->magic != AUTOMATON_MAGIC || head->version != AUTOMATON_VERSION || \
+            head->num_symbols != NUM_SYMBOLS || head->size != (uint64_t)st.st_size) {
+        printf("Bad automaton file %s\n", filename);
+        exit(-1);
+    }
+    if (!automaton_file_fits(head->nfa_range_pos, head->nfa_states + 1ULL, sizeof(uint32_t), st.st_size) || \
+            !automaton_file_fits(head->nfa_range, head->nfa_ranges, sizeof(Range), st.st_size) || \
+            !automaton_file_fits(head->nfa_eps_pos, head->nfa_states + 1ULL, sizeof(uint32_t), st.st_size) || \
+            !automaton_file_fits(head->nfa_eps_list, head->nfa_eps, sizeof(uint32_t), st.st_size) || \
+            !automaton_file_fits(head->nfa_final_status, head->nfa_states, sizeof(uint16_t), st.st_size) || \
+            !automaton_file_fits(head->dfa_byte_class, NUM_SYMBOLS, 1, st.st_size) || \
+            !automaton_file_fits(head->dfa_table, (uint64_t)head->dfa_states * head->dfa_classes, \
+                                 sizeof(uint16_t), st.st_size) || \
+            !automaton_file_fits(head->dfa_accept, head->dfa_states, sizeof(uint16_t), st.st_size) || \
+            !automaton_file_fits(head->dfa_skip, head->dfa_states, sizeof(Skip_Set), st.st_size) || \
+            (head->keyword_slots && \
+             (!head->keyword_shift || head->keyword_shift > 31 || \
+              head->keyword_slots != 1u << (32 - head->keyword_shift) || \
+              !automaton_file_fits(head->keyword_word, head->keyword_slots, sizeof(uint32_t), st.st_size) || \
+              !automaton_file_fits(head->keyword_len, head->keyword_slots, sizeof(uint32_t), st.st_size) || \
+              !automaton_file_fits(head->keyword_text, head->keyword_text_len, 1, st.st_size)))) {
+        printf("Truncated automaton file %s\n", filename);
+        exit(-1);
+    }
+
+    automaton          = automaton_init();
+    automaton->map     = map;
+    automaton->map_len = st.st_size;
+    memcpy(automaton->class_kind, head->class_kind, MAX_CLASS);
+
+    nfa               = malloc(sizeof(NFA));
+    nfa->num_states   = head->nfa_states;
+    nfa->range_pos    = (uint32_t*)(map + head->nfa_range_pos);
+    nfa->range        = (Range*)(map + head->nfa_range);
+    nfa->eps_pos      = (uint32_t*)(map + head->nfa_eps_pos);
+    nfa->eps          = (uint32_t*)(map + head->nfa_eps_list);
+    nfa->final_status = (uint16_t*)(map + head->nfa_final_status);
+    automaton->nfa    = nfa;
+
+    dfa_table              = malloc(sizeof(DFA_Table));
+    dfa_table->num_states  = head->dfa_states;
+    dfa_table->num_classes = head->dfa_classes;
+    dfa_table->table       = (uint16_t*)(map + head->dfa_table);
+    dfa_table->accept      = (uint16_t*)(map + head->dfa_accept);
+    dfa_table->skip        = (Skip_Set*)(map + head->dfa_skip);
+    memcpy(dfa_table->byte_class, map + head->dfa_byte_class, NUM_SYMBOLS);
+    dfa_table_skip_select(dfa_table);
+    automaton->dfa_table = dfa_table;
+
+    if (head->keyword_slots) {
+        keyword             = malloc(sizeof(Keyword_Set));
+        keyword->word       = (uint32_t*)(map + head->keyword_word);
+        keyword->len        = (uint32_t*)(map + head->keyword_len);
+        keyword->text       = map + head->keyword_text;
+        keyword->text_len   = head->keyword_text_len;
+        keyword->seed       = head->keyword_seed;
+        keyword->shift      = head->keyword_shift;
+        keyword->min_len    = head->keyword_min_len;
+        keyword->max_len    = head->keyword_max_len;
+        keyword->full       = head->keyword_full;
+        keyword->class      = head->keyword_class;
+        keyword->from_class = head->keyword_from_class;
+        automaton->keyword  = keyword;
+    }
+    return automaton;
+}
+// =============================================================================
+
+// =============================================================================
+// Code Generation
+// Print the compiled automaton as a standalone C scanner, one label per DFA
+// state with its accept action inlined and a switch over the next byte. The
+// generated reg_scan() behaves as match_scan() on the same rules, and with
+// -DREG_SCAN_MAIN the file builds into a tool printing what reg --dump does.
+void emit_c_byte(FILE* out, uint16_t symbol) {
+    if (symbol == '\'' || symbol == '\\')
+        fprintf(out, "'\\%c'", symbol);
+    else if (isprint(symbol))
+        fprintf(out, "'%c'", symbol);
+    else
+        fprintf(out, "%d", symbol);
+}
+
+// Quoted as emit_c_byte does, with ? escaped against trigraphs and other bytes
+// as three digit octal escapes
+void emit_c_string(FILE* out, char* text, uint32_t len) {
+    uint32_t idx;
+    fputc('"', out);
+    for (idx = 0; idx < len; ++idx) {
+        if (text[idx] == '"' || text[idx] == '\\' || text[idx] == '?')
+            fprintf(out, "\\%c", text[idx]);
+        else if (isprint((uint8_t)text[idx]))
+            fputc(text[idx], out);
+        else
+            fprintf(out, "\\%03o", (uint8_t)text[idx]);
+    }
+    fputc('"', out);
+}
+
+void emit_c_keyword(FILE* out, Keyword_Set* set) {
+    uint32_t size = 1u << (32 - set->shift);
+    uint32_t len;
+    uint32_t slot;
+    bool     first;
+
+    fprintf(out, "static int reg_keyword(const char* word, uint64_t len) {\n");
+    fprintf(out, "    switch (len) {\n");
+    for (len = set->min_len; len <= set->max_len; ++len) {
+        first = true;
+        for (slot = 0; slot < size; ++slot) {
+            if (set->len[slot] != len)
+                continue;
+            if (first)
+                fprintf(out, "        case %u:\n            return", len);
+            fprintf(out, "%s!memcmp(word, ", first? " ": " ||\n                   ");
+            emit_c_string(out, set->text + set->word[slot], len);
+            fprintf(out, ", %u)", len);
+            first = false;
+        }
+        if (!first)
+            fprintf(out, ";\n");
+    }
+    fprintf(out, "    }\n    return 0;\n}\n\n");
+}
+
+void automaton_emit_c(Automaton* automaton, FILE* out) {
+    DFA_Table* dfa_table = automaton->dfa_table;
+    uint16_t   state;
+    uint16_t   symbol;
+    uint16_t   other;
+    uint16_t   next;
+    uint16_t   count;
+    bool       done[NUM_SYMBOLS];
+    bool*      target = calloc(sizeof(bool), dfa_table->num_states);
+
+    for (state = 1; state < dfa_table->num_states; ++state)
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol)
+            target[dfa_table_step(dfa_table, state, symbol)] = true;
+
+    fprintf(out, "// Scanner generated by reg --emit-c, do not edit\n");
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+    if (automaton->keyword)
+        emit_c_keyword(out, automaton->keyword);
+
+    fprintf(out, "// Longest match of buf[pos, len), returns where it ends and sets final_status\n");
+    fprintf(out, "uint64_t reg_scan(const char* buf, uint64_t pos, uint64_t len, uint16_t* final_status) {\n");
+    fprintf(out, "    uint64_t start = pos;\n    uint64_t end   = pos;\n\n    *final_status = 0;\n");
+    for (state = 1; state < dfa_table->num_states; ++state) {
+        if (target[state])
+            fprintf(out, "state_%d:\n", state);
+        if (dfa_table->accept[state])
+            fprintf(out, "    *final_status = %d;\n    end           = pos;\n", dfa_table->accept[state]);
+        fprintf(out, "    if (pos == len)\n        goto done;\n");
+        fprintf(out, "    switch ((unsigned char)buf[pos++]) {\n");
+        memset(done, 0, sizeof(done));
+        for (symbol = 1; symbol < NUM_SYMBOLS; ++symbol) {
+            next = dfa_table_step(dfa_table, state, symbol);
+            if (done[symbol] || !next)
+                continue;
+            for (count = 0, other = symbol; other < NUM_SYMBOLS; ++other) {
+                if (done[other] || dfa_table_step(dfa_table, state, other) != next)
+                    continue;
+                fprintf(out, count % 8? " ": count? "\n        ": "        ");
+                fprintf(out, "case ");
+                emit_c_byte(out, other);
+                fprintf(out, ":");
+                done[other] = true;
+                ++count;
+            }
+            fprintf(out, "\n            goto state_%d;\n", next);
+        }
+        fprintf(out, "        default:\n            goto done;\n    }\n");
+    }
+    fprintf(out, "done:\n");
+    if (automaton->keyword)
+        fprintf(out, "    if (*final_status == %d && reg_keyword(buf + start, end - start))\n" \
+                "        *final_status = %d;\n", automaton->keyword->from_class, automaton->keyword->class);
+    else
+        fprintf(out, "    (void)start;\n");
+    fprintf(out, "    return end;\n}\n\n");
+
+    fprintf(out, "#ifdef REG_SCAN_MAIN\n");
+    fprintf(out, "int main(int argc, char** argv) {\n");
+    fprintf(out, "    FILE*    file = argc > 1? fopen(argv[1], \"rb\"): NULL;\n");
+    fprintf(out, "    uint64_t cap  = 1 << 16;\n    uint64_t len  = 0;\n    uint64_t pos  = 0;\n");
+    fprintf(out, "    uint64_t end;\n    uint16_t final_status;\n    size_t   got;\n");
+    fprintf(out, "    char*    buf  = malloc(cap);\n\n");
+    fprintf(out, "    if (!file)\n        return 1;\n");
+    fprintf(out, "    while ((got = fread(buf + len, 1, cap - len, file)) > 0)\n");
+    fprintf(out, "        if ((len += got) == cap)\n            buf = realloc(buf, cap *= 2);\n");
+    fprintf(out, "    while (pos < len) {\n");
+    fprintf(out, "        end = reg_scan(buf, pos, len, &final_status);\n");
+    fprintf(out, "        if (!final_status)\n            end = pos + 1;\n");
+    fprintf(out, "        printf(\"%%d %%lu %%lu\\n\", final_status, (unsigned long)pos, (unsigned long)(end - pos));\n");
+    fprintf(out, "        pos = end;\n    }\n");
+    fprintf(out, "    fclose(file);\n    free(buf);\n    return 0;\n}\n#endif\n");
+    free(target);
+}
+// =============================================================================
+
+// =============================================================================
+// Line Index
+// Tokens carry byte offsets only. Lines are found when a location is asked
+// for: one pass records where every line starts, and an offset is resolved
+// to its line by binary search over those starts.
+typedef struct {
+    uint32_t* start;            // start[line - 1] is where line begins
+    uint32_t  count;
+    uint32_t  cap;
+} Line_Index;
+
+void line_index_add(Line_Index* index, uint64_t pos) {
+    if (index->count == index->cap) {
+        index->cap  *= 2;
+        index->start = realloc(index->start, sizeof(uint32_t) * index->cap);
+    }
+    index->start[index->count++] = pos;
+}
+
+void line_index_scan_scalar(Line_Index* index, char* buf, uint64_t pos, uint64_t len) {
+    char* newline;
+    while ((newline = memchr(buf + pos, '\n', len - pos))) {
+        pos = newline - buf + 1;
+        line_index_add(index, pos);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+// 32 bytes a step, every set bit of the compare mask is a newline
+__attribute__((target("avx2,bmi")))
+void line_index_scan_avx2(Line_Index* index, char* buf, uint64_t pos, uint64_t len) {
+    __m256i  newline = _mm256_set1_epi8('\n');
+    uint32_t mask;
+
+    for (; pos + 32 <= len; pos += 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf + pos)), newline));
+        for (; mask; mask = _blsr_u32(mask))
+            line_index_add(index, pos + _tzcnt_u32(mask) + 1);
+    }
+    line_index_scan_scalar(index, buf, pos, len);
+}
+#endif
+
+Line_Index* line_index_init(char* buf, uint64_t len) {
+    Line_Index* index = malloc(sizeof(Line_Index));
+    index->cap   = len / 32 + 1;
+    index->count = 0;
+    index->start = malloc(sizeof(uint32_t) * index->cap);
+    line_index_add(index, 0);
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+        line_index_scan_avx2(index, buf, 0, len);
+        return index;
+    }
+#endif
+    line_index_scan_scalar(index, buf, 0, len);
+    return index;
+}
+
+void line_index_destroy(Line_Index* index) {
+    free(index->start);
+    free(index);
+}
+
+// Line and column of offset, both counted from 1, columns in bytes
+void line_index_locate(Line_Index* index, uint64_t offset, uint32_t* line, uint32_t* column) {
+    uint32_t low  = 0;
+    uint32_t high = index->count;
+    uint32_t mid;
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        if (index->start[mid] <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    *line   = low + 1;
+    *column = offset - index->start[low] + 1;
+}
+// =============================================================================
+
+// =============================================================================
+// Lexical
+#define READ_CHUNK     (1 << 16)
+#define TOKEN_CHUNK    1024
+#define CHUNK_MIN_SIZE (1 << 20)
+#define CHUNK_HEAD     256
+#define STREAM_CARRY   256
+
+#define CLASS_WHITE      1
+#define CLASS_IDENTIFIER 2
+#define CLASS_NUMBER     3
+#define CLASS_KEYWORD    4
+#define CLASS_OPERATOR   5
+#define CLASS_PUNCTUATOR 6
+
+union Token_content {
+    int64_t  d;
+    Symbol*  s; 
+};
+
+// The lexeme is the span [start, start + len) of the input buffer
+typedef struct {
+    uint16_t            class;
+    uint32_t            start;
+    uint32_t            len;
+    union Token_content content;
+} Token;
+
+// Value of a run of decimal digits, saturated at INT64_MAX
+int64_t decimal_value(char* text, uint32_t len) {
+    int64_t  value = 0;
+    int64_t  digit;
+    uint32_t idx;
+    for (idx = 0; idx < len; ++idx) {
+        digit = text[idx] - '0';
+        if (value > (INT64_MAX - digit) / 10)
+            return INT64_MAX;
+        value = value * 10 + digit;
+    }
+    return value;
+}
+
+// Tokens live in fixed blocks that never move, so a token stays where it is
+// until the arena is reset. A reset keeps the blocks for reuse.
+typedef struct token_block {
+    struct token_block* next;
+    Token               token[];
+} Token_Block;
+
+typedef struct {
+    Token_Block* first;
+    Token_Block* block;         // the block being filled
+    uint32_t     used;          // tokens taken from it
+    uint32_t     block_size;
+    uint32_t     count;
+} Token_Arena;
+
+Token_Block* token_block_init(uint32_t block_size) {
+    Token_Block* block = malloc(sizeof(Token_Block) + sizeof(Token) * block_size);
+    block->next        = NULL;
+    return block;
+}
+
+Token_Arena* token_arena_init(uint32_t block_size) {
+    Token_Arena* arena = malloc(sizeof(Token_Arena));
+    arena->block_size  = block_size? block_size: TOKEN_CHUNK;
+    arena->first       = token_block_init(arena->block_size);
+    arena->block       = arena->first;
+    arena->used        = 0;
+    arena->count       = 0;
+    return arena;
+}
+
+Token* token_arena_alloc(Token_Arena* arena) {
+    if (arena->used == arena->block_size) {
+        if (!arena->block->next)
+            arena->block->next = token_block_init(arena->block_size);
+        arena->block = arena->block->next;
+        arena->used  = 0;
+    }
+    ++arena->count;
+    return arena->block->token + arena->used++;
+}
+
+// Give back the token just allocated
+void token_arena_unalloc(Token_Arena* arena) {
+    --arena->used;
+    --arena->count;
+}
+
+void token_arena_reset(Token_Arena* arena) {
+    arena->block = arena->first;
+    arena->used  = 0;
+    arena->count = 0;
+}
+
+void token_arena_destroy(Token_Arena* arena) {
+    Token_Block* block;
+    Token_Block* next;
+    for (block = arena->first; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+// Structure of arrays, token idx is (classes[idx], starts[idx], ...). A reach
+// is one past the farthest byte any scan so far has read, the input length
+// plus one once a scan ran into the end; reaches[idx] is the reach when token
+// idx was added. lex_edit uses them to find tokens an edit cannot change.
+typedef struct {
+    uint16_t*            classes;
+    uint32_t*            starts;
+    uint32_t*            lengths;
+    uint32_t*            reaches;
+    union Token_content* values;
+    uint32_t             count;
+    uint32_t             cap;
+    uint64_t             reach;
+} Token_Buffer;
+
+Token_Buffer* token_buffer_init(uint32_t cap) {
+    Token_Buffer* buffer = malloc(sizeof(Token_Buffer));
+    buffer->cap     = cap? cap: TOKEN_CHUNK;
+    buffer->count   = 0;
+    buffer->reach   = 0;
+    buffer->classes = malloc(sizeof(uint16_t) * buffer->cap);
+    buffer->starts  = malloc(sizeof(uint32_t) * buffer->cap);
+    buffer->lengths = malloc(sizeof(uint32_t) * buffer->cap);
+    buffer->reaches = malloc(sizeof(uint32_t) * buffer->cap);
+    buffer->values  = malloc(sizeof(union Token_content) * buffer->cap);
+    return buffer;
+}
+
+void token_buffer_grow(Token_Buffer* buffer) {
+    buffer->cap    *= 2;
+    buffer->classes = realloc(buffer->classes, sizeof(uint16_t) * buffer->cap);
+    buffer->starts  = realloc(buffer->starts,  sizeof(uint32_t) * buffer->cap);
+    buffer->lengths = realloc(buffer->lengths, sizeof(uint32_t) * buffer->cap);
+    buffer->reaches = realloc(buffer->reaches, sizeof(uint32_t) * buffer->cap);
+    buffer->values  = realloc(buffer->values,  sizeof(union Token_content) * buffer->cap);
+}
+
+void token_buffer_destroy(Token_Buffer* buffer) {
+    free(buffer->classes);
+    free(buffer->starts);
+    free(buffer->lengths);
+    free(buffer->reaches);
+    free(buffer->values);
+    free(buffer);
+}
+
+// A Lex built with lex_init owns its rules and automaton. One made with
+// lex_init_shared scans with another's compiled automaton and must not
+// outlive it or append rules.
+typedef struct {
+    NFA_Builder* builder;
+    Automaton*   automaton;
+    Match_Ctx*   ctx;
+    char*        buf;
+    uint64_t     buf_len;
+    uint64_t     buf_pos;
+    bool         buf_mapped;
+    Line_Index*  lines;         // built on the first lex_locate
+    uint16_t     final_status;
+    bool         (*post_process)(uint16_t, char*, uint32_t, Symbol_Table*, Token*);
 } Lex;
 
-Lex* lex_init(char* input_filename, Token* (*post_process)(uint16_t, char*, Symbol_Table*)) {
-    Lex* lex          = malloc(sizeof(Lex));
-    lex->nfa          = state_init(0, NULL);
-    lex->stream       = fopen(input_filename, "r");
-    lex->final_status = 0;
-    lex->post_process = post_process;
+// Map the input when it is a regular file, otherwise read it all in. A NULL
+// filename leaves the input empty.
+void lex_open(Lex* lex, char* input_filename) {
+    struct stat st;
+    uint64_t    cap = READ_CHUNK;
+    ssize_t     len;
+    int         fd;
+
+    lex->buf        = NULL;
+    lex->buf_len    = 0;
+    lex->buf_pos    = 0;
+    lex->buf_mapped = false;
+    if (!input_filename)
+        return;
+
+    fd = strcmp(input_filename, "-")? open(input_filename, O_RDONLY): 0;
+    if (fd < 0) {
+        printf("Cannot open %s\n", input_filename);
+        exit(-1);
+    }
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= UINT32_MAX) {
+        lex->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (lex->buf != MAP_FAILED) {
+            madvise(lex->buf, st.st_size, MADV_SEQUENTIAL);
+            lex->buf_len    = st.st_size;
+            lex->buf_mapped = true;
+            close(fd);
+            return;
+        }
+    }
+
+    lex->buf = malloc(cap);
+    while ((len = read(fd, lex->buf + lex->buf_len, cap - lex->buf_len)) > 0) {
+        lex->buf_len += len;
+        if (lex->buf_len == cap) {
+            cap     *= 2;
+            lex->buf = realloc(lex->buf, cap);
+        }
+    }
+    if (fd)
+        close(fd);
+    if (lex->buf_len > UINT32_MAX) {
+        printf("Input tooooo long\n");
+        exit(-1);
+    }
+}
+
+void lex_close(Lex* lex) {
+    if (lex->buf_mapped)
+        munmap(lex->buf, lex->buf_len);
+    else
+        free(lex->buf);
+    if (lex->lines)
+        line_index_destroy(lex->lines);
+    lex->lines   = NULL;
+    lex->buf     = NULL;
+    lex->buf_len = 0;
+}
+
+Lex* lex_init_shared(Automaton* automaton, char* input_filename, \
+        bool (*post_process)(uint16_t, char*, uint32_t, Symbol_Table*, Token*)) {
+    Lex* lex          = malloc(sizeof(Lex));
+    lex->builder      = NULL;
+    lex->automaton    = automaton;
+    lex->ctx          = match_ctx_init(automaton, DFA_CACHE_BUDGET);
+    lex->lines        = NULL;
+    lex->final_status = 0;
+    lex->post_process = post_process;
+    lex_open(lex, input_filename);
+
+    return lex;
+}
+
+Lex* lex_init(char* input_filename, \
+        bool (*post_process)(uint16_t, char*, uint32_t, Symbol_Table*, Token*)) {
+    Lex* lex     = lex_init_shared(automaton_init(), input_filename, post_process);
+    lex->builder = nfa_builder_init();
+    state_add(lex->builder, 0);
+
+    return lex;
+}
+
+void lex_destroy(Lex* lex) {
+    lex_close(lex);
+    match_ctx_destroy(lex->ctx);
+    if (lex->builder) {
+        automaton_destroy(lex->automaton);
+        nfa_builder_destroy(lex->builder);
+    }
+    free(lex);
+}
+
+void lex_append_rule(Lex* lex, char* rule, uint16_t final_status) {
+    Literal_Set* literals;
+    Regnode*     root;
+    Fragment     nfa;
+    if (!final_status || final_status >= MAX_CLASS) {
+        printf("Bad rule class %d\n", final_status);
+        exit(-1);
+    }
+    if (!lex->builder) {
+        printf("Rules of a shared automaton are fixed\n");
+        exit(-1);
+    }
+    match_ctx_reset(lex->ctx);
+    automaton_reset(lex->automaton);
+    root     = regexp_to_regnode(rule);
+    literals = calloc(1, sizeof(Literal_Set));
+    if (regnode_literals(root, literals))
+        nfa = literals_to_nfa(lex->builder, literals, final_status);
+    else
+        nfa = regnode_to_nfa(lex->builder, root, final_status);
+    eps_add(lex->builder, 0, nfa.start);
+    free(literals);
+    regnode_destroy(root);
+}
+
+// Tokens of from_class spelled as one of the words are reported as class
+// instead. A later call replaces the earlier set.
+void lex_add_keywords(Lex* lex, char** words, uint16_t num_words, uint16_t class, uint16_t from_class) {
+    if (!class || class >= MAX_CLASS) {
+        printf("Bad rule class %d\n", class);
+        exit(-1);
+    }
+    if (!from_class || from_class >= MAX_CLASS) {
+        printf("Bad rule class %d\n", from_class);
+        exit(-1);
+    }
+    if (lex->automaton->keyword)
+        keyword_set_destroy(lex->automaton->keyword);
+    lex->automaton->keyword = keyword_set_init(words, num_words, class, from_class);
+}
+
+// How lex_tokenize_all treats tokens of a class
+void lex_set_class(Lex* lex, uint16_t class, uint8_t kind) {
+    if (!class || class >= MAX_CLASS) {
+        printf("Bad rule class %d\n", class);
+        exit(-1);
+    }
+    lex->automaton->class_kind[class] = kind;
+}
 
-    return lex;
+void lex_compile_nfa(Lex* lex) {
+    NFA* nfa;
+    if (lex->automaton->nfa)
+        return;
+    nfa                 = nfa_compile(lex->builder);
+    lex->automaton->nfa = nfa_remove_eps(nfa);
+    nfa_destroy(nfa);
 }
 
-void lex_destroy(Lex* lex) {
-    fclose(lex->stream);
-    state_destroy(lex->nfa);
-    free(lex);
+// Build the minimized DFA table once all rules are appended. Afterwards the
+// automaton can be shared through lex_init_shared.
+Automaton* lex_compile(Lex* lex) {
+    lex_compile_nfa(lex);
+    if (!lex->automaton->dfa_table)
+        lex->automaton->dfa_table = dfa_table_init(lex->automaton->nfa);
+    return lex->automaton;
 }
 
-void lex_append_rule(Lex* lex, char* rule, uint16_t final_status) {
-    Regnode* root;
-    State*   nfa;
-    root = regexp_to_regnode(rule);
-    nfa  = regnode_to_nfa(root, final_status);
-    state_append(lex->nfa, nfa);
-    trans_add(lex->nfa, EPS, nfa);
-    /*print_nfa(nfa);*/
-    /*regnode_print(root);*/
-    /*printf("\n");*/
-    regnode_destroy(root);
+uint64_t lex_scan(Lex* lex) {
+    if (!lex->automaton->nfa)
+        lex_compile_nfa(lex);
+    return match_scan(lex->ctx, lex->buf, lex->buf_pos, lex->buf_len, &lex->final_status);
 }
 
-Token* lex_get_token(Lex* lex, Symbol_Table* table) {
-    char symbol;
-    char content[MAX_TOKEN_LEN];
-    uint16_t select_count;
-    uint16_t final_status;
-    uint16_t pre_final_status;
-    uint64_t content_pos_s = ftell(lex->stream);
+// Line and column of an input offset, e.g. of token->start
+void lex_locate(Lex* lex, uint64_t offset, uint32_t* line, uint32_t* column) {
+    if (!lex->lines)
+        lex->lines = line_index_init(lex->buf, lex->buf_len);
+    line_index_locate(lex->lines, offset, line, column);
+}
+
+// Every lexing path reports its errors here, line and column count from 1
+void lex_error_report(uint64_t line, uint64_t column) {
+    printf("Lexical Error at %lu:%lu\n", line, column);
+}
+
+void lex_error(Lex* lex, uint64_t offset) {
+    uint32_t line;
+    uint32_t column;
+    lex_locate(lex, offset, &line, &column);
+    lex_error_report(line, column);
+}
+
+// Fill the caller's token with the next kept token, false at end of input
+bool lex_next(Lex* lex, Symbol_Table* table, Token* token) {
+    uint64_t content_pos_s;
     uint64_t content_pos_e;
-    Token* token;
 
-    NFA_init(lex->nfa, &select_count, &final_status);
-    lex->final_status = 0;
+    while (lex->buf_pos < lex->buf_len) {
+        content_pos_s = lex->buf_pos;
+        content_pos_e = lex_scan(lex);
+        if (!lex->final_status) {
+            lex_error(lex, content_pos_s);
+            lex->buf_pos = content_pos_s + 1;
+            continue;
+        }
+        lex->buf_pos = content_pos_e;
+        token->class = lex->final_status;
+        token->start = content_pos_s;
+        token->len   = content_pos_e - content_pos_s;
+        if (lex->post_process(lex->final_status, lex->buf + content_pos_s, token->len, table, token))
+            return true;
+    }
+    return false;
+}
+
+Token* lex_get_token(Lex* lex, Symbol_Table* table, Token_Arena* arena) {
+    Token* token = token_arena_alloc(arena);
+    if (lex_next(lex, table, token))
+        return token;
+    token_arena_unalloc(arena);
+    return NULL;
+}
+
+// The value of a token of class as lex_set_class asks, symbols are interned
+// only when a table is given
+union Token_content lex_token_value(uint8_t kind, uint16_t class, char* text, uint32_t len, Symbol_Table* table) {
+    union Token_content value;
+    value.d = 0;
+    if (kind == KIND_SYMBOL && table)
+        value.s = push_symbol(table, class, text, len);
+    else if (kind == KIND_NUMBER)
+        value.d = decimal_value(text, len);
+    return value;
+}
+
+// A slice of the input lexed speculatively from begin, as if a token started
+// there. Errors are kept as class 0 tokens and symbols are left uninterned
+// until the merge has decided which tokens are real.
+typedef struct {
+    uint64_t      begin;
+    uint64_t      stop;
+    uint64_t      end;
+    uint64_t      head[CHUNK_HEAD];
+    uint16_t      num_head;
+    Token_Buffer* tokens;
+} Lex_Chunk;
 
-    while (fread(&symbol, sizeof(char), 1, lex->stream)) {
-        NFA_move(lex->nfa, &select_count, &final_status, symbol);  
-        if (!select_count) {
-            if (lex->final_status) {
-                content_pos_e = ftell(lex->stream) - 1;
-                fseek(lex->stream, content_pos_s, SEEK_SET);
-                fread(content, sizeof(char), content_pos_e - content_pos_s, lex->stream); 
-                content[content_pos_e - content_pos_s] = 0;
-                /*printf("%d %s\n", lex->final_status, content);*/
+// Scan the tokens of the input starting in [pos, stop) with ctx, returns where
+// the last one ends. Symbols are interned only when a table is given.
+uint64_t lex_tokenize_span(Lex* lex, Match_Ctx* ctx, uint64_t pos, uint64_t stop, \
+        Token_Buffer* buffer, Symbol_Table* table, Lex_Chunk* chunk) {
+    uint8_t* class_kind = ctx->automaton->class_kind;
+    char*    buf        = lex->buf;
+    uint64_t len        = lex->buf_len;
+    uint64_t content_pos_s;
+    uint64_t content_pos_e;
+    uint16_t final_status;
+    uint32_t count;
+    uint8_t  kind;
+
+    while (pos < stop) {
+        content_pos_s = pos;
+        content_pos_e = match_scan(ctx, buf, pos, len, &final_status);
+        if (ctx->stop + (ctx->stop == len) > buffer->reach)
+            buffer->reach = ctx->stop + (ctx->stop == len);
+        if (chunk && chunk->num_head < CHUNK_HEAD)
+            chunk->head[chunk->num_head++] = content_pos_s;
+        if (!final_status) {
+            pos = content_pos_s + 1;
+            if (!chunk) {
+                lex_error(lex, content_pos_s);
+                continue;
             }
-            else
-                printf("Lexical Error\n");
-            token = lex->post_process(lex->final_status, content, table);
-            if (token)
-                return token;
-            else
-                return lex_get_token(lex, table);
+            content_pos_e = pos;
+            kind          = KIND_KEEP;
+        }
+        else {
+            pos  = content_pos_e;
+            kind = class_kind[final_status];
+            if (kind == KIND_SKIP)
+                continue;
+        }
+
+        if (buffer->count == buffer->cap)
+            token_buffer_grow(buffer);
+        count                   = buffer->count++;
+        buffer->classes[count]  = final_status;
+        buffer->starts[count]   = content_pos_s;
+        buffer->lengths[count]  = content_pos_e - content_pos_s;
+        buffer->reaches[count]  = buffer->reach;
+        buffer->values[count]   = lex_token_value(kind, final_status, buf + content_pos_s, \
+                content_pos_e - content_pos_s, table);
+    }
+    return pos;
+}
+
+// Tokenize the rest of the input in one pass, values follow lex->class_kind
+Token_Buffer* lex_tokenize_all(Lex* lex, Symbol_Table* table) {
+    Token_Buffer* buffer = token_buffer_init((lex->buf_len - lex->buf_pos) / 8 + 1);
+    if (!lex->automaton->nfa)
+        lex_compile_nfa(lex);
+    lex->buf_pos = lex_tokenize_span(lex, lex->ctx, lex->buf_pos, lex->buf_len, buffer, table, NULL);
+    return buffer;
+}
+
+typedef struct {
+    Lex*          lex;
+    Symbol_Table* table;
+    Match_Ctx**   ctx;
+    Lex_Chunk*    chunk;
+    Token_Buffer* tokens;
+    uint32_t      num_part;
+} Lex_Parallel;
+
+void lex_chunk_run(void* arg, uint16_t worker, uint32_t task) {
+    Lex_Parallel* par   = arg;
+    Lex_Chunk*    chunk = par->chunk + task;
+    chunk->tokens = token_buffer_init((chunk->stop - chunk->begin) / 8 + 1);
+    chunk->end    = lex_tokenize_span(par->lex, par->ctx[worker], chunk->begin, chunk->stop, \
+            chunk->tokens, NULL, chunk);
+}
+
+void lex_intern_run(void* arg, uint16_t worker, uint32_t task) {
+    Lex_Parallel* par    = arg;
+    Token_Buffer* tokens = par->tokens;
+    uint8_t*      kind   = par->lex->automaton->class_kind;
+    uint64_t      first  = (uint64_t)tokens->count * task / par->num_part;
+    uint64_t      last   = (uint64_t)tokens->count * (task + 1) / par->num_part;
+    for (; first < last; ++first)
+        if (kind[tokens->classes[first]] == KIND_SYMBOL)
+            tokens->values[first].s = push_symbol(par->table, tokens->classes[first], \
+                    par->lex->buf + tokens->starts[first], tokens->lengths[first]);
+}
+
+// Append the tokens of chunk starting at or after pos, reporting its errors.
+// Reaches include the chunk's speculative scans, which can only overstate them.
+void lex_chunk_append(Lex* lex, Token_Buffer* buffer, Lex_Chunk* chunk, uint64_t pos) {
+    Token_Buffer* tokens = chunk->tokens;
+    uint32_t      idx;
+    uint32_t      count;
+    for (idx = 0; idx < tokens->count && tokens->starts[idx] < pos; ++idx);
+    for (; idx < tokens->count; ++idx) {
+        if (!tokens->classes[idx]) {
+            lex_error(lex, tokens->starts[idx]);
+            continue;
+        }
+        if (buffer->count == buffer->cap)
+            token_buffer_grow(buffer);
+        count                   = buffer->count++;
+        buffer->classes[count]  = tokens->classes[idx];
+        buffer->starts[count]   = tokens->starts[idx];
+        buffer->lengths[count]  = tokens->lengths[idx];
+        buffer->values[count]   = tokens->values[idx];
+        if (tokens->reaches[idx] > buffer->reach)
+            buffer->reach = tokens->reaches[idx];
+        buffer->reaches[count]  = buffer->reach;
+    }
+    if (tokens->reach > buffer->reach)
+        buffer->reach = tokens->reach;
+}
+
+// Same tokens as lex_tokenize_all, lexed by num_workers threads. The input is
+// cut into chunks, each starting just after a newline near its nominal
+// boundary, and every chunk is lexed as if a token started there. The merge
+// then walks the chunks in order: once the real token stream reaches a scan
+// position the chunk also passed through, the rest of the chunk is exact;
+// before that, or if it never happens, the gap is lexed again serially.
+// Symbols are interned last, in parallel when the table is concurrent, and
+// left uninterned without a table.
+Token_Buffer* lex_tokenize_parallel(Lex* lex, Symbol_Table* table, uint16_t num_workers) {
+    Lex_Parallel  par;
+    Token_Buffer* buffer;
+    Lex_Chunk*    chunk;
+    uint64_t      size      = lex->buf_len - lex->buf_pos;
+    uint32_t      num_chunk = size / CHUNK_MIN_SIZE;
+    uint32_t      total     = 0;
+    uint64_t      pos;
+    uint32_t      idx;
+    uint16_t      head;
+    char*         newline;
+
+    if (num_chunk > (uint32_t)num_workers * 4)
+        num_chunk = num_workers * 4;
+    if (num_workers < 2 || num_chunk < 2)
+        return lex_tokenize_all(lex, table);
+    if (!lex->automaton->nfa)
+        lex_compile_nfa(lex);
+
+    par.lex   = lex;
+    par.table = table;
+    par.ctx   = malloc(sizeof(Match_Ctx*) * num_workers);
+    par.chunk = malloc(sizeof(Lex_Chunk) * num_chunk);
+    for (idx = 0; idx < num_workers; ++idx)
+        par.ctx[idx] = match_ctx_init(lex->automaton, DFA_CACHE_BUDGET);
+    for (idx = 0; idx < num_chunk; ++idx) {
+        chunk           = par.chunk + idx;
+        chunk->begin    = lex->buf_pos + size * idx / num_chunk;
+        chunk->num_head = 0;
+        newline         = memchr(lex->buf + chunk->begin, '\n', size / num_chunk / 2);
+        if (idx && newline)
+            chunk->begin = newline - lex->buf + 1;
+        if (idx)
+            par.chunk[idx - 1].stop = chunk->begin;
+    }
+    par.chunk[num_chunk - 1].stop = lex->buf_len;
+
+    work_pool_run(num_workers, num_chunk, lex_chunk_run, &par);
+
+    for (idx = 0; idx < num_chunk; ++idx)
+        total += par.chunk[idx].tokens->count;
+    buffer = token_buffer_init(total + 1);
+    for (pos = lex->buf_pos, idx = 0; idx < num_chunk; ++idx) {
+        chunk = par.chunk + idx;
+        head  = 0;
+        while (pos < chunk->stop) {
+            while (head < chunk->num_head && chunk->head[head] < pos)
+                ++head;
+            if (head < chunk->num_head && chunk->head[head] == pos) {
+                lex_chunk_append(lex, buffer, chunk, pos);
+                pos = chunk->end;
+                break;
+            }
+            pos = lex_tokenize_span(lex, lex->ctx, pos, pos + 1, buffer, NULL, NULL);
+        }
+        token_buffer_destroy(chunk->tokens);
+    }
+    lex->buf_pos = pos;
+
+    if (table) {
+        par.tokens   = buffer;
+        par.num_part = table->shard? num_workers: 1;
+        work_pool_run(par.num_part, par.num_part, lex_intern_run, &par);
+    }
+
+    for (idx = 0; idx < num_workers; ++idx)
+        match_ctx_destroy(par.ctx[idx]);
+    free(par.ctx);
+    free(par.chunk);
+    return buffer;
+}
+
+// Push lexing for input that arrives in pieces, e.g. a pipe or a socket.
+// lex_feed hands over the next piece and lex_finish ends the input. A token
+// is emitted once the automaton died before the end of the bytes seen so far,
+// so no later byte can extend it. Only the token still pending is carried to
+// the next piece, the carry grows with the longest token, not the input.
+// The DFA state of the pending token is kept too, a piece is read from where
+// the last one stopped instead of from the start of the token.
+// Emitted text is valid during the call only, token->start wraps past 4 GiB
+// and the full stream offset is passed as start.
+typedef struct {
+    Match_Ctx*    ctx;
+    Symbol_Table* table;
+    char*         carry;
+    uint64_t      carry_len;
+    uint64_t      carry_cap;
+    uint64_t      offset;       // stream offset of carry[0]
+    uint64_t      scanned;      // bytes of the pending token read, 0 if none
+    uint16_t      state;        // table state after them
+    uint16_t      final_status; // longest match among them
+    uint64_t      match_len;    // and its length
+    uint64_t      counted;      // newlines before it are counted
+    uint64_t      line;         // how many there are
+    uint64_t      line_start;   // offset after the last of them
+    void          (*emit)(void*, Token*, char*, uint64_t);
+    void*         arg;
+} Lex_Stream;
+
+// The automaton must be compiled, see lex_compile
+Lex_Stream* lex_stream_init(Automaton* automaton, Symbol_Table* table, \
+        void (*emit)(void*, Token*, char*, uint64_t), void* arg) {
+    Lex_Stream* stream = malloc(sizeof(Lex_Stream));
+    stream->ctx        = match_ctx_init(automaton, DFA_CACHE_BUDGET);
+    stream->table      = table;
+    stream->carry_cap  = STREAM_CARRY;
+    stream->carry_len  = 0;
+    stream->carry      = malloc(stream->carry_cap);
+    stream->offset     = 0;
+    stream->scanned    = 0;
+    stream->match_len  = 0;
+    stream->counted    = 0;
+    stream->line       = 0;
+    stream->line_start = 0;
+    stream->emit       = emit;
+    stream->arg        = arg;
+    return stream;
+}
+
+void lex_stream_destroy(Lex_Stream* stream) {
+    match_ctx_destroy(stream->ctx);
+    free(stream->carry);
+    free(stream);
+}
+
+void lex_stream_append(Lex_Stream* stream, char* buf, uint64_t len) {
+    if (stream->carry_len + len > stream->carry_cap) {
+        while (stream->carry_len + len > stream->carry_cap)
+            stream->carry_cap *= 2;
+        stream->carry = realloc(stream->carry, stream->carry_cap);
+    }
+    memcpy(stream->carry + stream->carry_len, buf, len);
+    stream->carry_len += len;
+}
+
+// Count the newlines of the stream up to offset upto, buf[0] being at stream
+// offset base. Bytes are counted once, just before they are left behind.
+void lex_stream_count(Lex_Stream* stream, char* buf, uint64_t base, uint64_t upto) {
+    char* pos = buf + (stream->counted - base);
+    char* end = buf + (upto - base);
+    char* newline;
+    while ((newline = memchr(pos, '\n', end - pos))) {
+        ++stream->line;
+        stream->line_start = base + (newline - buf) + 1;
+        pos                = newline + 1;
+    }
+    stream->counted = upto;
+}
+
+// match_scan of buf[pos, len) resumed from the pending token, which starts at
+// pos. A match still alive at len is kept pending unless last.
+uint64_t lex_stream_match(Lex_Stream* stream, char* buf, uint64_t pos, uint64_t len, bool last, \
+        uint16_t* final_status) {
+    Automaton* automaton = stream->ctx->automaton;
+    uint64_t   next      = pos + stream->scanned;
+    uint64_t   end       = pos + stream->match_len;
+    uint16_t   state     = stream->scanned? stream->state: 1;
+
+    *final_status   = stream->scanned? stream->final_status: 0;
+    state           = match_table_run(automaton->dfa_table, state, buf, &next, len, final_status, &end);
+    stream->scanned = 0;
+    if (state && next == len && !last) {
+        stream->scanned      = next - pos;
+        stream->state        = state;
+        stream->final_status = *final_status;
+        stream->match_len    = end - pos;
+        return end;
+    }
+    stream->match_len = 0;
+    match_keyword(automaton, buf, pos, end, final_status);
+    return end;
+}
+
+// Emit the tokens of buf[pos, len), buf[0] being at stream offset base and
+// newlines counted up to base + pos. Returns where the first token that may
+// still grow starts, len if none.
+uint64_t lex_stream_scan(Lex_Stream* stream, char* buf, uint64_t pos, uint64_t len, uint64_t base, bool last) {
+    uint8_t* class_kind = stream->ctx->automaton->class_kind;
+    uint64_t end;
+    uint16_t final_status;
+    uint8_t  kind;
+    Token    token;
 
+    while (pos < len) {
+        end = lex_stream_match(stream, buf, pos, len, last, &final_status);
+        if (stream->scanned)
+            break;
+        if (!final_status) {
+            lex_stream_count(stream, buf, base, base + pos);
+            lex_error_report(stream->line + 1, base + pos - stream->line_start + 1);
+            ++pos;
+            continue;
+        }
+        kind = class_kind[final_status];
+        if (kind != KIND_SKIP) {
+            token.class   = final_status;
+            token.start   = base + pos;
+            token.len     = end - pos;
+            token.content = lex_token_value(kind, final_status, buf + pos, end - pos, stream->table);
+            stream->emit(stream->arg, &token, buf + pos, base + pos);
+        }
+        pos = end;
+    }
+    lex_stream_count(stream, buf, base, base + pos);
+    return pos;
+}
+
+void lex_feed(Lex_Stream* stream, char* buf, uint64_t len) {
+    uint64_t pos = 0;
+    uint64_t step;
+    uint64_t end;
+
+    // Finish the pending token first, growing the carry by its own size
+    // so a long token is copied a bounded number of times
+    while (stream->carry_len && pos < len) {
+        step = stream->carry_len > STREAM_CARRY? stream->carry_len: STREAM_CARRY;
+        if (step > len - pos)
+            step = len - pos;
+        lex_stream_append(stream, buf + pos, step);
+        pos += step;
+        end  = lex_stream_scan(stream, stream->carry, 0, stream->carry_len, stream->offset, false);
+        stream->offset += end;
+        if (end + step >= stream->carry_len) {
+            // The rest started in buf, scan it there
+            pos              -= stream->carry_len - end;
+            stream->carry_len = 0;
+            break;
         }
+        memmove(stream->carry, stream->carry + end, stream->carry_len - end);
+        stream->carry_len -= end;
+    }
+    if (stream->carry_len)
+        return;
+
+    end             = lex_stream_scan(stream, buf, pos, len, stream->offset - pos, false);
+    stream->offset += end - pos;
+    lex_stream_append(stream, buf + end, len - end);
+}
+
+// End of input, the pending token is complete now
+void lex_finish(Lex_Stream* stream) {
+    lex_stream_scan(stream, stream->carry, 0, stream->carry_len, stream->offset, true);
+    stream->offset   += stream->carry_len;
+    stream->carry_len = 0;
+}
+
+// Number of tokens starting before pos
+uint32_t token_buffer_rank(Token_Buffer* buffer, uint64_t pos) {
+    uint32_t low  = 0;
+    uint32_t high = buffer->count;
+    uint32_t mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (buffer->starts[mid] < pos)
+            low = mid + 1;
         else
-            lex->final_status = final_status;
+            high = mid;
     }
-    return NULL;
+    return low;
 }
-// =============================================================================
 
-Token* lex_post_process(uint16_t final_status, char* content, Symbol_Table* table) {
-    if (final_status == CLASS_WHITE)
-        return NULL;
+// Replace tokens [first, last) of buffer by those of fresh and move the
+// starts and reaches of the tokens after them by delta. Reaches after fresh
+// are at least its own, an old reach may overstate the new one, never less.
+void token_buffer_splice(Token_Buffer* buffer, uint32_t first, uint32_t last, Token_Buffer* fresh, int64_t delta) {
+    uint32_t tail  = buffer->count - last;
+    uint32_t count = first + fresh->count + tail;
+    uint32_t idx;
+
+    while (count > buffer->cap)
+        token_buffer_grow(buffer);
+    memmove(buffer->classes + first + fresh->count, buffer->classes + last, sizeof(uint16_t) * tail);
+    memmove(buffer->starts  + first + fresh->count, buffer->starts  + last, sizeof(uint32_t) * tail);
+    memmove(buffer->lengths + first + fresh->count, buffer->lengths + last, sizeof(uint32_t) * tail);
+    memmove(buffer->reaches + first + fresh->count, buffer->reaches + last, sizeof(uint32_t) * tail);
+    memmove(buffer->values  + first + fresh->count, buffer->values  + last, sizeof(union Token_content) * tail);
+    memcpy(buffer->classes + first, fresh->classes, sizeof(uint16_t) * fresh->count);
+    memcpy(buffer->starts  + first, fresh->starts , sizeof(uint32_t) * fresh->count);
+    memcpy(buffer->lengths + first, fresh->lengths, sizeof(uint32_t) * fresh->count);
+    memcpy(buffer->reaches + first, fresh->reaches, sizeof(uint32_t) * fresh->count);
+    memcpy(buffer->values  + first, fresh->values , sizeof(union Token_content) * fresh->count);
+    for (idx = first + fresh->count; idx < count; ++idx) {
+        buffer->starts[idx]  += delta;
+        buffer->reaches[idx] += delta;
+        if (buffer->reaches[idx] < fresh->reach)
+            buffer->reaches[idx] = fresh->reach;
+    }
+    buffer->reach = tail && buffer->reach + delta > fresh->reach? buffer->reach + delta: fresh->reach;
+    buffer->count = count;
+}
+
+// Replace deleted bytes at offset of the input by text and update tokens,
+// the result of lex_tokenize_all over the whole input, to match. Lexing
+// restarts after the last token whose reach shows that no scan up to it read
+// anything from offset on, however far the rules look ahead. Every token starts the
+// automaton afresh, so once a new token starts past the edit where an old
+// one started, the rest of the old stream is exact and only shifted. The
+// scanning is proportional to the damaged region, the input and the tokens
+// after it are moved once.
+void lex_edit(Lex* lex, Token_Buffer* tokens, Symbol_Table* table, \
+        uint64_t offset, uint64_t deleted, char* text, uint64_t inserted) {
+    Token_Buffer* fresh;
+    uint64_t      len   = lex->buf_len - deleted + inserted;
+    uint64_t      edit  = offset + inserted;
+    int64_t       delta = inserted - deleted;
+    uint64_t      pos   = 0;
+    uint32_t      keep;
+    uint32_t      last;
+    uint32_t      high;
+    uint32_t      mid;
+    char*         buf;
+
+    if (offset + deleted > lex->buf_len || len > UINT32_MAX) {
+        printf("Bad edit at %lu\n", offset);
+        exit(-1);
+    }
+    if (!lex->automaton->nfa)
+        lex_compile_nfa(lex);
+
+    // A mapped input is read only, take a copy to edit
+    if (lex->buf_mapped) {
+        buf = malloc(len + 1);
+        memcpy(buf, lex->buf, offset);
+        memcpy(buf + edit, lex->buf + offset + deleted, lex->buf_len - offset - deleted);
+        munmap(lex->buf, lex->buf_len);
+        lex->buf        = buf;
+        lex->buf_mapped = false;
+    }
+    else {
+        if (delta > 0)
+            lex->buf = realloc(lex->buf, len + 1);
+        memmove(lex->buf + edit, lex->buf + offset + deleted, lex->buf_len - offset - deleted);
+    }
+    memcpy(lex->buf + offset, text, inserted);
+    lex->buf_len = len;
+    lex->buf_pos = len;
+    if (lex->lines)
+        line_index_destroy(lex->lines);
+    lex->lines = NULL;
+
+    // Reaches never decrease, find the last token that reached at most offset
+    for (keep = 0, high = token_buffer_rank(tokens, offset); keep < high;) {
+        mid = keep + (high - keep + 1) / 2;
+        if (tokens->reaches[mid - 1] <= offset)
+            keep = mid;
+        else
+            high = mid - 1;
+    }
+    if (keep)
+        pos = tokens->starts[keep - 1] + tokens->lengths[keep - 1];
+
+    fresh        = token_buffer_init(0);
+    fresh->reach = keep? tokens->reaches[keep - 1]: 0;
+    last         = keep;
+    while (pos < len) {
+        if (pos >= edit) {
+            while (last < tokens->count && (int64_t)tokens->starts[last] + delta < (int64_t)pos)
+                ++last;
+            if (last < tokens->count && (int64_t)tokens->starts[last] + delta == (int64_t)pos)
+                break;
+        }
+        pos = lex_tokenize_span(lex, lex->ctx, pos, pos + 1, fresh, table, NULL);
+    }
+    if (pos >= len)
+        last = tokens->count;
+    token_buffer_splice(tokens, keep, last, fresh, delta);
+    token_buffer_destroy(fresh);
+}
+// =============================================================================
 
-    Token* token = malloc(sizeof(Token));
-    token->class = final_status;
+bool lex_post_process(uint16_t final_status, char* content, uint32_t len, Symbol_Table* table, Token* token) {
     switch (final_status) {
         case CLASS_IDENTIFIER:
-            token->content.s = push_symbol(table, final_status, content);
-            return token;
+            token->content.s = push_symbol(table, final_status, content, len);
+            return true;
         case CLASS_NUMBER:
-            token->content.d = atoi(content);
-            return token;
+            token->content.d = decimal_value(content, len);
+            return true;
         case CLASS_KEYWORD:
         case CLASS_OPERATOR:
         case CLASS_PUNCTUATOR:
-            strcpy(token->content.c, content);
-            return token;
+            token->content.d = 0;
+            return true;
         default:
-            return NULL;
+            return false;
+    }
+}
+
+void lex_c_rules(Lex* lex) {
+    lex_append_rule(lex, "\\w+"                       , 1); // White Space
+    lex_append_rule(lex, "(_|\\z|\\u)(_|\\z|\\d|\\U)*", 2); // Identifier
+    lex_append_rule(lex, "\\d+"                       , 3); // Number
+    char* keywords[] = {"auto", "else", "long", "switch",
+                        "break", "enum", "register", "typedef",
+                        "case", "extern", "restrict", "union",
+                        "char", "float", "return", "unsigned",
+                        "const", "for", "short", "void",
+                        "continue", "goto", "signed", "volatile",
+                        "default", "if", "sizeof", "while",
+                        "do", "inline", "static",
+                        "double", "int", "struct"};
+    lex_add_keywords(lex, keywords, sizeof(keywords) / sizeof(char*), \
+                     CLASS_KEYWORD, CLASS_IDENTIFIER); // Key Word
+    lex_append_rule(lex, "\\[|\\]|->|.|"
+                         "\\+|-|\\*|/|%|&|~|\\+\\+|--|"
+                         ">>|<<|>|<|>=|<=|==|!=|"
+                         "&|\\||^|&&|\\|\\||!|\\?|:|"
+                         "=|\\+=|-=|\\*=|/=|%=|>>=|<<=|"
+                         "&=|\\|=|^=|,"              , 5); // Operator
+    lex_append_rule(lex, ",|;|\\(|\\)|{|}"            , 6); // Punctuators
+    lex_set_class(lex, CLASS_WHITE     , KIND_SKIP);
+    lex_set_class(lex, CLASS_IDENTIFIER, KIND_SYMBOL);
+    lex_set_class(lex, CLASS_NUMBER    , KIND_NUMBER);
+}
+
+// =============================================================================
+// Driver
+// reg [-j workers] [-a automaton] file...  lexes every file against one
+// compiled automaton, the C rules or a saved one, and interns identifiers
+// into one concurrent symbol table. A single file is cut into chunks lexed
+// in parallel instead, and "-" streams standard input through lex_feed.
+// reg --save out             compiles the C rules into an automaton file
+// reg --emit-c [out.c]       prints the C rules as a generated scanner
+// reg --dump file            prints every match as "class start length", the
+//                            format of the generated scanner's own main
+// reg --grep regexp file     prints every match of regexp as "start length"
+// reg --check-edit file      checks lex_edit against full lexing, see Edit Check
+typedef struct {
+    Automaton*    automaton;
+    Symbol_Table* table;
+    char**        filename;
+    Lex**         lex;
+    uint64_t*     num_bytes;
+    uint64_t*     num_tokens;
+} Drive;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void lex_drive_file(void* arg, uint16_t worker, uint32_t task) {
+    Drive*        drive = arg;
+    Lex*          lex   = drive->lex[worker];
+    Token_Buffer* tokens;
+
+    lex_open(lex, drive->filename[task]);
+    tokens = lex_tokenize_all(lex, drive->table);
+    drive->num_bytes[worker]  += lex->buf_len;
+    drive->num_tokens[worker] += tokens->count;
+    token_buffer_destroy(tokens);
+    lex_close(lex);
+}
+
+void lex_drive_count(void* arg, Token* token, char* text, uint64_t start) {
+    ++*(uint64_t*)arg;
+}
+
+int lex_drive(int argc, char** argv) {
+    Drive    drive;
+    Lex*     rules       = lex_init(NULL, lex_post_process);
+    uint16_t num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t num_bytes   = 0;
+    uint64_t num_tokens  = 0;
+    char*    saved       = NULL;
+    uint16_t worker;
+    double   time;
+
+    for (; argc > 2 && argv[1][0] == '-' && argv[1][1]; argc -= 2, argv += 2)
+        if (!strcmp(argv[1], "-j"))
+            num_workers = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-a"))
+            saved = argv[2];
+        else
+            break;
+    if (!num_workers)
+        num_workers = 1;
+
+    time = now_sec();
+    if (saved)
+        drive.automaton = automaton_load(saved);
+    else {
+        lex_c_rules(rules);
+        drive.automaton = lex_compile(rules);
+    }
+    drive.table      = symbol_table_init_concurrent();
+    drive.filename   = argv + 1;
+    drive.lex        = malloc(sizeof(Lex*) * num_workers);
+    drive.num_bytes  = calloc(sizeof(uint64_t), num_workers);
+    drive.num_tokens = calloc(sizeof(uint64_t), num_workers);
+    for (worker = 0; worker < num_workers; ++worker)
+        drive.lex[worker] = lex_init_shared(drive.automaton, NULL, lex_post_process);
+
+    if (argc == 2 && !strcmp(argv[1], "-")) {
+        // A pipe may never end, lex it as it arrives
+        Lex_Stream* stream = lex_stream_init(drive.automaton, drive.table, lex_drive_count, drive.num_tokens);
+        char*       buf    = malloc(READ_CHUNK);
+        ssize_t     len;
+        while ((len = read(0, buf, READ_CHUNK)) > 0) {
+            lex_feed(stream, buf, len);
+            drive.num_bytes[0] += len;
+        }
+        lex_finish(stream);
+        lex_stream_destroy(stream);
+        free(buf);
+    }
+    else if (argc == 2) {
+        // One file, split it between the workers instead
+        Lex*          lex = drive.lex[0];
+        Token_Buffer* tokens;
+        lex_open(lex, argv[1]);
+        tokens               = lex_tokenize_parallel(lex, drive.table, num_workers);
+        drive.num_bytes[0]   = lex->buf_len;
+        drive.num_tokens[0]  = tokens->count;
+        token_buffer_destroy(tokens);
+    }
+    else
+        work_pool_run(num_workers, argc - 1, lex_drive_file, &drive);
+
+    for (worker = 0; worker < num_workers; ++worker) {
+        num_bytes  += drive.num_bytes[worker];
+        num_tokens += drive.num_tokens[worker];
+        lex_destroy(drive.lex[worker]);
+    }
+    time = now_sec() - time;
+    printf("files = %d, workers = %d, bytes = %lu, tokens = %lu, symbols = %lu\n", \
+           argc - 1, num_workers, num_bytes, num_tokens, symbol_table_count(drive.table));
+    printf("time = %.3f s, %.1f MB/s\n", time, num_bytes / time / 1e6);
+
+    symbol_table_destroy(drive.table);
+    free(drive.lex);
+    free(drive.num_bytes);
+    free(drive.num_tokens);
+    if (saved)
+        automaton_destroy(drive.automaton);
+    lex_destroy(rules);
+    STAT_DUMP(stderr, false);
+    return 0;
+}
+int lex_save(int argc, char** argv) {
+    Lex* lex = lex_init(NULL, lex_post_process);
+    if (argc < 2) {
+        printf("Usage: reg --save file\n");
+        exit(-1);
+    }
+    lex_c_rules(lex);
+    automaton_save(lex_compile(lex), argv[1]);
+    lex_destroy(lex);
+    return 0;
+}
+
+int lex_emit_c(int argc, char** argv) {
+    Lex*  lex = lex_init(NULL, lex_post_process);
+    FILE* out = argc > 1? fopen(argv[1], "w"): stdout;
+    if (!out) {
+        printf("Cannot open %s\n", argv[1]);
+        exit(-1);
+    }
+    lex_c_rules(lex);
+    automaton_emit_c(lex_compile(lex), out);
+    if (out != stdout)
+        fclose(out);
+    lex_destroy(lex);
+    return 0;
+}
+
+void lex_grep_print(void* arg, uint64_t start, uint64_t end) {
+    printf("%lu %lu\n", start, end - start);
+}
+
+int lex_grep(int argc, char** argv) {
+    Search* search;
+    Lex*    lex;
+
+    if (argc < 3) {
+        printf("Usage: reg --grep regexp file\n");
+        exit(-1);
+    }
+    search = search_init(argv[1]);
+    lex    = lex_init_shared(search->automaton, argv[2], NULL);
+    search_find_all(search, lex->buf, lex->buf_len, lex_grep_print, NULL);
+    lex_destroy(lex);
+    search_destroy(search);
+    return 0;
+}
+
+// Errors are reported as class 0 matches of one byte
+int lex_dump(int argc, char** argv) {
+    Lex*     lex = lex_init(NULL, lex_post_process);
+    uint64_t end;
+
+    if (argc < 2) {
+        printf("Usage: reg --dump file\n");
+        exit(-1);
+    }
+    lex_c_rules(lex);
+    lex_compile(lex);
+    lex_open(lex, argv[1]);
+    while (lex->buf_pos < lex->buf_len) {
+        end = lex_scan(lex);
+        if (!lex->final_status)
+            end = lex->buf_pos + 1;
+        printf("%d %lu %lu\n", lex->final_status, lex->buf_pos, end - lex->buf_pos);
+        lex->buf_pos = end;
+    }
+    lex_destroy(lex);
+    return 0;
+}
+
+// =============================================================================
+
+// =============================================================================
+// Benchmark
+// reg --bench [megabytes [repeats]] times rule compilation and lexing of
+// synthetic C corpora. Each result is one JSON object per line holding the
+// median and best of the repeats, so runs can be diffed or fed to scripts.
+// Every lex result is measured in a forked process that compiles its own
+// engine, so its peak_rss_kb covers that engine and API only.
+#define BENCH_SIZE   16
+#define BENCH_REPEAT 5
+#define BENCH_LONG   4096
+
+typedef struct {
+    char*  name;
+    double ident;    // share of tokens that are identifiers or keywords
+    double comment;  // share of lines that are comments
+    double longest;  // share of identifiers and blanks made up to BENCH_LONG long
+} Bench_Corpus;
+
+Bench_Corpus bench_corpus[] = {
+    {"mixed"  , 0.50, 0.10, 0.000},
+    {"ident"  , 0.85, 0.05, 0.000},
+    {"comment", 0.40, 0.60, 0.000},
+    {"long"   , 0.50, 0.10, 0.020},
+};
+
+// Operator and punctuator spellings of C
+char* bench_punct[] = {",", ";", "(", ")", "{", "}", "[", "]", "->", ".", "?", ":", \
+                       "+", "-", "*", "/", "%", "&", "|", "^", "~", "!", "<<", ">>", \
+                       "==", "!=", "<", ">", "<=", ">=", "&&", "||", "++", "--", "=", \
+                       "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>="};
+char* bench_keyword[] = {"int", "char", "return", "if", "else", "while", "for", "struct", \
+                         "static", "void", "unsigned", "const", "sizeof", "break"};
+
+uint64_t bench_rand(uint64_t* seed) {
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545f4914f6cdd1dULL;
+}
+
+int bench_cmp(const void* a, const void* b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+double bench_median(double* time, uint16_t num) {
+    qsort(time, num, sizeof(double), bench_cmp);
+    return num % 2? time[num / 2]: (time[num / 2 - 1] + time[num / 2]) / 2;
+}
+
+uint64_t bench_peak_rss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void bench_ident(FILE* file, uint64_t* seed, bool longest) {
+    static char first[] = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    static char rest[]  = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    uint64_t    len     = longest? bench_rand(seed) % BENCH_LONG + 1: bench_rand(seed) % 10;
+    fputc(first[bench_rand(seed) % (sizeof(first) - 1)], file);
+    while (len--)
+        fputc(rest[bench_rand(seed) % (sizeof(rest) - 1)], file);
+}
+
+// Write a corpus of about size bytes to a temporary file, returns its name.
+// The same corpus and size always give the same bytes.
+char* bench_corpus_write(Bench_Corpus* corpus, uint64_t size) {
+    char     name[] = "/tmp/reg_bench_XXXXXX";
+    int      fd     = mkstemp(name);
+    FILE*    file   = fdopen(fd, "w");
+    uint64_t seed   = 0x9e3779b97f4a7c15ULL;
+    uint64_t num;
+    double   dice;
+
+    if (fd < 0 || !file) {
+        printf("Cannot create bench corpus\n");
+        exit(-1);
+    }
+    while ((uint64_t)ftell(file) < size) {
+        fputs("    ", file);
+        if (bench_rand(&seed) % 1000 < corpus->comment * 1000) {
+            // No comment rule yet, these lex as operators and identifiers
+            fputs("//", file);
+            for (num = bench_rand(&seed) % 12; num; --num) {
+                fputc(' ', file);
+                bench_ident(file, &seed, false);
+            }
+            fputc('\n', file);
+            continue;
+        }
+        for (num = bench_rand(&seed) % 12 + 1; num; --num) {
+            dice = (bench_rand(&seed) % 1000) / 1000.0;
+            if (dice < corpus->ident * 0.8)
+                bench_ident(file, &seed, bench_rand(&seed) % 1000 < corpus->longest * 1000);
+            else if (dice < corpus->ident)
+                fputs(bench_keyword[bench_rand(&seed) % (sizeof(bench_keyword) / sizeof(char*))], file);
+            else if (dice < corpus->ident + (1 - corpus->ident) / 3)
+                fprintf(file, "%lu", bench_rand(&seed) % 100000);
+            else
+                fputs(bench_punct[bench_rand(&seed) % (sizeof(bench_punct) / sizeof(char*))], file);
+            if (bench_rand(&seed) % 1000 < corpus->longest * 1000)
+                fprintf(file, "%*s", (int)(bench_rand(&seed) % BENCH_LONG), "");
+            fputc(' ', file);
+        }
+        fputs(";\n", file);
+    }
+    fclose(file);
+    return strdup(name);
+}
+
+// Seconds to lex the whole file, token by token or into a Token_Buffer
+double bench_lex(Automaton* automaton, char* filename, bool all, uint64_t* num_bytes, uint64_t* num_tokens) {
+    Lex*          lex   = lex_init_shared(automaton, filename, lex_post_process);
+    Symbol_Table* table = symbol_table_init();
+    Token_Arena*  arena = token_arena_init(TOKEN_CHUNK);
+    Token_Buffer* tokens;
+    double        time  = now_sec();
+
+    *num_tokens = 0;
+    if (all) {
+        tokens      = lex_tokenize_all(lex, table);
+        *num_tokens = tokens->count;
+        token_buffer_destroy(tokens);
+    }
+    else
+        while (lex_get_token(lex, table, arena))
+            if (++(*num_tokens) % TOKEN_CHUNK == 0)
+                token_arena_reset(arena);
+    time       = now_sec() - time;
+    *num_bytes = lex->buf_len;
+
+    token_arena_destroy(arena);
+    symbol_table_destroy(table);
+    lex_destroy(lex);
+    return time;
+}
+
+void bench_compile(uint16_t num_repeat) {
+    double*  rule_time = malloc(sizeof(double) * num_repeat);
+    double*  nfa_time  = malloc(sizeof(double) * num_repeat);
+    double*  dfa_time  = malloc(sizeof(double) * num_repeat);
+    uint16_t num_states = 0;
+    uint16_t repeat;
+    double   time;
+    Lex*     lex;
+
+    for (repeat = 0; repeat < num_repeat; ++repeat) {
+        time = now_sec();
+        lex  = lex_init(NULL, lex_post_process);
+        lex_c_rules(lex);
+        rule_time[repeat] = now_sec() - time;
+        time              = now_sec();
+        lex_compile_nfa(lex);
+        nfa_time[repeat]  = now_sec() - time;
+        time              = now_sec();
+        lex_compile(lex);
+        dfa_time[repeat]  = now_sec() - time;
+        num_states        = lex->automaton->dfa_table->num_states;
+        lex_destroy(lex);
+    }
+    printf("{\"bench\": \"compile\", \"repeats\": %d, \"dfa_states\": %d, " \
+           "\"rules_ms\": %.3f, \"nfa_ms\": %.3f, \"dfa_ms\": %.3f}\n", num_repeat, num_states, \
+           bench_median(rule_time, num_repeat) * 1e3, bench_median(nfa_time, num_repeat) * 1e3, \
+           bench_median(dfa_time, num_repeat) * 1e3);
+    free(rule_time);
+    free(nfa_time);
+    free(dfa_time);
+}
+
+// Run one engine and API over a corpus in this process and print its result
+void bench_engine(Bench_Corpus* corpus, char* filename, uint8_t kind, uint8_t api, uint16_t num_repeat) {
+    static char* engine_name[2] = {"table", "lazy"};
+    static char* api_name[2]    = {"get_token", "tokenize_all"};
+    Lex*         lex            = lex_init(NULL, lex_post_process);
+    double*      time           = malloc(sizeof(double) * num_repeat);
+    Automaton*   engine;
+    uint64_t     num_bytes;
+    uint64_t     num_tokens;
+    uint16_t     repeat;
+    double       median;
+
+    lex_c_rules(lex);
+    if (kind)
+        lex_compile_nfa(lex);
+    else
+        lex_compile(lex);
+    engine = lex->automaton;
+    for (repeat = 0; repeat < num_repeat; ++repeat)
+        time[repeat] = bench_lex(engine, filename, api, &num_bytes, &num_tokens);
+    median = bench_median(time, num_repeat);
+    printf("{\"bench\": \"lex\", \"corpus\": \"%s\", \"engine\": \"%s\", \"api\": \"%s\", " \
+           "\"repeats\": %d, \"bytes\": %lu, \"tokens\": %lu, \"seconds\": %.6f, " \
+           "\"best_seconds\": %.6f, \"mb_per_s\": %.2f, \"mtokens_per_s\": %.3f, " \
+           "\"peak_rss_kb\": %lu}\n", corpus->name, engine_name[kind], api_name[api], \
+           num_repeat, num_bytes, num_tokens, median, time[0], \
+           num_bytes / median / 1e6, num_tokens / median / 1e6, bench_peak_rss());
+    STAT_DUMP(stdout, true);
+    fflush(stdout);
+    free(time);
+    lex_destroy(lex);
+}
+
+int lex_bench(int argc, char** argv) {
+    uint64_t size       = (argc > 1? atoi(argv[1]): BENCH_SIZE) * (1ULL << 20);
+    uint16_t num_repeat = argc > 2? atoi(argv[2]): BENCH_REPEAT;
+    uint16_t idx;
+    uint8_t  kind;
+    uint8_t  api;
+    char*    filename;
+    pid_t    pid;
+
+    if (!num_repeat)
+        num_repeat = 1;
+    bench_compile(num_repeat);
+    fflush(stdout);
+    for (idx = 0; idx < sizeof(bench_corpus) / sizeof(Bench_Corpus); ++idx) {
+        filename = bench_corpus_write(bench_corpus + idx, size);
+        for (kind = 0; kind < 2; ++kind)
+            for (api = 0; api < 2; ++api) {
+                pid = fork();
+                if (pid < 0) {
+                    printf("Cannot fork bench\n");
+                    exit(-1);
+                }
+                if (!pid) {
+                    bench_engine(bench_corpus + idx, filename, kind, api, num_repeat);
+                    _exit(0);
+                }
+                waitpid(pid, NULL, 0);
+            }
+        unlink(filename);
+        free(filename);
     }
+    return 0;
+}
+// =============================================================================
+
+// =============================================================================
+// Edit Check
+// reg --check-edit file [edits] applies random edits to file through lex_edit
+// and compares the tokens after each with a full lex_tokenize_all, after a
+// case whose rules look ahead over several tokens. Exits 1 on a mismatch.
+#define CHECK_EDITS 1000
+
+bool check_edit_same(Lex* lex, Token_Buffer* tokens) {
+    Token_Buffer* full;
+    uint32_t      idx;
+    bool          same;
+
+    lex->buf_pos = 0;
+    full         = lex_tokenize_all(lex, NULL);
+    same         = full->count == tokens->count;
+    for (idx = 0; same && idx < full->count; ++idx)
+        same = full->classes[idx] == tokens->classes[idx] && full->starts[idx] == tokens->starts[idx] && \
+               full->lengths[idx] == tokens->lengths[idx] && full->values[idx].d == tokens->values[idx].d;
+    token_buffer_destroy(full);
+    return same;
+}
+
+// x y y w lexes as three tokens, but the scan of x reads up to w. Replacing
+// w by z must bring back the one token xyyz.
+bool check_edit_lookahead() {
+    Lex*          lex = lex_init(NULL, lex_post_process);
+    Token_Buffer* tokens;
+    bool          same;
+
+    lex_append_rule(lex, "x"   , 1);
+    lex_append_rule(lex, "y"   , 2);
+    lex_append_rule(lex, "xyyz", 3);
+    lex_compile(lex);
+    lex->buf     = strdup("xyyw");
+    lex->buf_len = 4;
+    tokens       = lex_tokenize_all(lex, NULL);
+    lex_edit(lex, tokens, NULL, 3, 1, "z", 1);
+    same = tokens->count == 1 && tokens->classes[0] == 3 && check_edit_same(lex, tokens);
+    token_buffer_destroy(tokens);
+    lex_destroy(lex);
+    return same;
 }
 
-int main() {
-    /*Regnode* S = regexp_to_regnode("(a|b)*abb#");*/
-    /*regnode_print(S);*/
-    /*printf("\n");*/
+int lex_check_edit(int argc, char** argv) {
+    static char*  piece[] = {"", " ", "a", "1", "/*", "\n", "x = y;", "\"", "ab", "+=", "->", ">>=", "@"};
+    uint32_t      num_edit;
+    uint32_t      edit;
+    uint64_t      seed = 0x9e3779b97f4a7c15ULL;
+    uint64_t      offset;
+    uint64_t      deleted;
+    char*         text;
+    Lex*          lex;
+    Token_Buffer* tokens;
 
-    /*State* nfa = regnode_to_nfa(S, 1);*/
-    /*print_nfa(nfa);*/
+    if (argc < 2) {
+        printf("Usage: reg --check-edit file [edits]\n");
+        exit(-1);
+    }
+    if (!check_edit_lookahead()) {
+        printf("lex_edit differs from a full lex on the lookahead case\n");
+        return 1;
+    }
+    num_edit = argc > 2? atoi(argv[2]): CHECK_EDITS;
+    lex      = lex_init(argv[1], lex_post_process);
+    lex_c_rules(lex);
+    lex_compile(lex);
+    tokens = lex_tokenize_all(lex, NULL);
+    for (edit = 0; edit < num_edit; ++edit) {
+        offset  = bench_rand(&seed) % (lex->buf_len + 1);
+        deleted = bench_rand(&seed) % 6;
+        if (deleted > lex->buf_len - offset)
+            deleted = lex->buf_len - offset;
+        text = piece[bench_rand(&seed) % (sizeof(piece) / sizeof(char*))];
+        lex_edit(lex, tokens, NULL, offset, deleted, text, strlen(text));
+        if (!check_edit_same(lex, tokens)) {
+            printf("lex_edit differs from a full lex after edit %u at %lu\n", edit, offset);
+            return 1;
+        }
+    }
+    printf("%u edits, %u tokens, all equal to a full lex\n", num_edit, tokens->count);
+    token_buffer_destroy(tokens);
+    lex_destroy(lex);
+    return 0;
+}
+// =============================================================================
 
-    /*NFA_run(&nfa, "aabb#abb#");*/
-    /*NFA_run(&nfa, "abb#");*/
-    /*NFA_run(&nfa, "");*/
-    /*NFA_run(&nfa, "ascas");*/
-    /*state_destroy(nfa);*/
-    /*regnode_destroy(S);*/
+int main(int argc, char** argv) {
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+        return lex_bench(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "--save"))
+        return lex_save(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "--emit-c"))
+        return lex_emit_c(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "--dump"))
+        return lex_dump(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "--grep"))
+        return lex_grep(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "--check-edit"))
+        return lex_check_edit(argc - 1, argv + 1);
+    if (argc > 1)
+        return lex_drive(argc, argv);
 
     Symbol_Table* table = symbol_table_init();
     Lex* lex = lex_init("test.c", lex_post_process);
-    lex_append_rule(lex, "\\w+"               , 1); // White Space
-    lex_append_rule(lex, "(_|\\z)(_|\\z|\\d)*", 2); // Identifier
-    lex_append_rule(lex, "\\d+"               , 3); // Number
-    lex_append_rule(lex, "auto|else|long|switch|         \
-                          break|enum|register|typedef|   \
-                          case|extern|restrict|union|    \
-                          char|float|return|unsigned|    \
-                          const|for|short|void|          \
-                          continue|goto|signed|volatile| \
-                          default|if|sizeof|while|       \
-                          do|inline|static|              \
-                          double|int|struct"  , 4); // Key Word
-    lex_append_rule(lex, "[|]|->|.| \
-                          \\+|-|\\*|/|&|~|\\+\\+|--|    \
-                          >>|<<|>|<|>=|<=|==|!=|        \
-                          &|\\||^|&&|\\|\\||!|\\?|:|    \
-                          =|\\+=|-=|\\*=|/=|%=|>>=|<<=| \
-                          &=|\\|=|^=|,"       , 5); // Operator
-    lex_append_rule(lex, ",|;|\\(|\\)|{|}"    , 6); // Punctuators
-
-    for (uint16_t count = 0; count < 10; ++count) {
-        Token* token = lex_get_token(lex, table);
-        if (!token)
-            break;
-        switch (token->class) {
+    lex_c_rules(lex);
+    lex_compile(lex);
+
+    Token_Buffer* tokens = lex_tokenize_all(lex, table);
+    for (uint32_t count = 0; count < 10 && count < tokens->count; ++count) {
+        switch (tokens->classes[count]) {
             case CLASS_WHITE:
                 printf("HAIYAA\n");
                 break;
             case CLASS_IDENTIFIER:
-                printf("ID  %s\n", token->content.s->content);
+                printf("ID  %s\n", tokens->values[count].s->content);
                 break;
             case CLASS_NUMBER:
-                printf("NUM %ld\n", token->content.d);
+                printf("NUM %ld\n", tokens->values[count].d);
                 break;
             case CLASS_KEYWORD:
-                printf("KEY %s\n", token->content.c);
+                printf("KEY %.*s\n", tokens->lengths[count], lex->buf + tokens->starts[count]);
                 break;
             case CLASS_OPERATOR:
-                printf("OPE %s\n", token->content.c);
+                printf("OPE %.*s\n", tokens->lengths[count], lex->buf + tokens->starts[count]);
                 break;
             case CLASS_PUNCTUATOR:
-                printf("PUN %s\n", token->content.c);
+                printf("PUN %.*s\n", tokens->lengths[count], lex->buf + tokens->starts[count]);
                 break;
         }
     }
 
+    token_buffer_destroy(tokens);
+    symbol_table_destroy(table);
     lex_destroy(lex);
+    STAT_DUMP(stderr, false);
 
     return 0;
 }